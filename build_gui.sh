@@ -3,9 +3,45 @@
 echo "Building Simple Chat GUI..."
 echo
 
+# Compile the headless client library (no raylib) for the GUI, bots and tools
+echo "Compiling chat_client.cpp..."
+g++ -c chat_client.cpp -o chat_client.o -std=c++11 -O2 && ar rcs libchat_client.a chat_client.o
+
+if [ $? -ne 0 ]; then
+    echo "Failed to compile!"
+    exit 1
+fi
+
 # Compile the GUI chat application
 echo "Compiling chat_gui.cpp..."
-g++ chat_gui.cpp -o chat_gui -lraylib -lGL -lm -lpthread -ldl -lrt -lX11 -std=c++11
+g++ chat_gui.cpp -o chat_gui -L. -lchat_client -lraylib -lGL -lm -lpthread -ldl -lrt -lX11 -lz -std=c++11 -O2
+
+if [ $? -ne 0 ]; then
+    echo "Failed to compile!"
+    exit 1
+fi
+
+# Compile the load generator
+echo "Compiling chat_loadgen.cpp..."
+g++ chat_loadgen.cpp -o chat_loadgen -L. -lchat_client -lpthread -lrt -lz -std=c++11 -O2
+
+if [ $? -ne 0 ]; then
+    echo "Failed to compile!"
+    exit 1
+fi
+
+# Compile the benchmarks
+echo "Compiling chat_bench.cpp..."
+g++ chat_bench.cpp -o chat_bench -L. -lchat_client -lpthread -lrt -lz -std=c++11 -O2
+
+if [ $? -ne 0 ]; then
+    echo "Failed to compile!"
+    exit 1
+fi
+
+# Compile the self-check
+echo "Compiling chat_selftest.cpp..."
+g++ chat_selftest.cpp -o chat_selftest -L. -lchat_client -lpthread -lrt -lz -std=c++11 -O2
 
 if [ $? -ne 0 ]; then
     echo "Failed to compile!"
@@ -16,6 +52,9 @@ echo
 echo "Build successful!"
 echo "Run './chat_gui YourName' to start chatting"
 echo "Example: ./chat_gui Alice"
+echo "Run './chat_loadgen -w 8 -r 8 -R 1000' to put load on the chat"
+echo "Run './chat_bench -o bench.jsonl' to benchmark the hot paths"
+echo "Run './chat_selftest' to check checksums, latency percentiles and snapshots"
 echo
 
-chmod +x chat_gui
+chmod +x chat_gui chat_loadgen chat_bench chat_selftest
@@ -0,0 +1,240 @@
+// Micro-benchmarks for the client hot paths: parsing ring messages as the
+// receiver does, splicing them into the history as check_messages() does,
+// publishing to and consuming from the ring, message layout in the history
+// y index, and building the visible draw list, for histories of 1k, 100k
+// and 1M messages. Each result is one JSON object per line, so runs can be
+// compared by a script:
+//   {"bench":"draw_list","messages":100000,"ops":2000,"ns_per_op":812.4}
+// Glyph layout needs the GUI's font atlas and is not covered here.
+#include "chat_client_internal.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <chrono>
+#include <unistd.h>
+
+#define BENCH_SENDERS 8
+#define BENCH_TEXTS 1024         // Distinct message texts cycled through
+#define BENCH_RING_BATCH 64      // Ring writes per reservation and wakeup
+#define VIEW_HEIGHT 360          // Chat area height of the GUI
+
+struct BenchOptions {
+    std::vector<size_t> sizes;  // History sizes
+    size_t ring_messages;
+    size_t frames;              // Draw lists built per history size
+};
+
+FILE* bench_out = stdout;
+
+std::vector<std::string> bench_texts;
+
+double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+void bench_report(const char* name, size_t messages, size_t ops, double ns) {
+    fprintf(bench_out, "{\"bench\":\"%s\",\"messages\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f}\n", name, messages, ops,
+            ops > 0 ? ns / ops : 0.0);
+    fflush(bench_out);
+}
+
+// "userN: text" lines of mixed lengths, like a busy channel
+void bench_init_texts() {
+    const char* words[] = { "hello", "the", "build", "is", "green", "again", "naïve", "東京", "ship", "it" };
+    std::mt19937 random(1);
+    for (int i = 0; i < BENCH_TEXTS; i++) {
+        std::string line = "user" + std::to_string(i % BENCH_SENDERS) + ": ";
+        size_t words_in = 1 + std::exponential_distribution<double>(1.0 / 8)(random);
+        for (size_t w = 0; w < words_in && line.size() < MESSAGE_MAX - 32; w++) {
+            if (w > 0) line += ' ';
+            line += words[random() % 10];
+        }
+        bench_texts.push_back(line);
+    }
+}
+
+void bench_message(size_t i, RingMessage& msg) {
+    const std::string& line = bench_texts[i % BENCH_TEXTS];
+    msg.seq = i;
+    msg.writer = 1;
+    msg.client_seq = (uint32_t)i;
+    msg.timestamp = 1700000000000LL + (int64_t)i;
+    msg.sent_us = 0;
+    msg.length = (uint32_t)line.size();
+    memcpy(msg.data, line.data(), line.size());
+}
+
+// receiver_parse alone: split "sender: text" and work out the flags
+void bench_parse(size_t count) {
+    std::vector<RingMessage> messages(BENCH_TEXTS);
+    for (size_t i = 0; i < messages.size(); i++) bench_message(i, messages[i]);
+    IngestItem* item = new IngestItem();
+
+    size_t parsed = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) parsed += receiver_parse(messages[i % BENCH_TEXTS], *item);
+    double ns = elapsed_ns(start);
+    if (parsed != count) std::cerr << "Parse failed for " << count - parsed << " messages" << std::endl;
+    bench_report("parse", count, count, ns);
+    delete item;
+}
+
+// Publish in batches with one wakeup each, then read them all back. The
+// reader trails by one batch so nothing is overwritten.
+void bench_ring(size_t count) {
+    ShmRing* ring = (ShmRing*)calloc(1, sizeof(ShmRing));
+    std::vector<RingPayload> batch(BENCH_RING_BATCH);
+    RingCursor cursor = { 0, 0, 0, 0 };
+    RingMessage* msg = new RingMessage();
+    double publish_ns = 0, consume_ns = 0;
+
+    for (size_t i = 0; i < count; i += BENCH_RING_BATCH) {
+        for (size_t k = 0; k < BENCH_RING_BATCH; k++) {
+            const std::string& line = bench_texts[(i + k) % BENCH_TEXTS];
+            RingPayload payload = { (uint32_t)(i + k), 0, line.data(), line.size() };
+            batch[k] = payload;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ring_write_batch(ring, 1, &batch[0], batch.size());
+        ring_notify(ring);
+        publish_ns += elapsed_ns(start);
+
+        start = std::chrono::steady_clock::now();
+        while (ring_next(ring, cursor, *msg)) {
+        }
+        consume_ns += elapsed_ns(start);
+    }
+    size_t published = (count + BENCH_RING_BATCH - 1) / BENCH_RING_BATCH * BENCH_RING_BATCH;
+    if (cursor.lost > 0 || cursor.corrupt > 0) {
+        std::cerr << "Ring lost " << cursor.lost << ", corrupt " << cursor.corrupt << std::endl;
+    }
+    bench_report("ring_publish", published, published, publish_ns);
+    bench_report("ring_consume", published, published, consume_ns);
+    delete msg;
+    free(ring);
+}
+
+// check_messages splicing parsed items into a fresh history and search
+// index, a queue full at a time
+void bench_ingest(size_t count) {
+    history_free(chat_messages);
+    history_init(chat_messages);
+    search_index = SearchIndex();
+    IngestQueue queue;
+    queue.items = new IngestItem[INGEST_QUEUE_SLOTS];
+    queue.head = 0;
+    queue.tail = 0;
+    std::vector<ChatSubscriber> subscribers;
+    RingMessage* msg = new RingMessage();
+
+    double ns = 0;
+    for (size_t i = 0; i < count;) {
+        IngestItem* item;
+        while (i < count && (item = ingest_queue_reserve(queue)) != NULL) {
+            bench_message(i++, *msg);
+            if (receiver_parse(*msg, *item)) ingest_queue_push(queue);
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        check_messages(queue, INT64_MAX, subscribers);
+        ns += elapsed_ns(start);
+    }
+    bench_report("ingest", count, count, ns);
+    delete msg;
+    delete[] queue.items;
+}
+
+// Placing messages in the history: bubble height and the page y index
+void bench_layout(MessageHistory& history, size_t count) {
+    history_init(history);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        const std::string& line = bench_texts[i % BENCH_TEXTS];
+        size_t colon = line.find(": ");
+        history_append(history, line.data(), colon, line.data() + colon + 2, line.size() - colon - 2,
+                       i % BENCH_SENDERS == 0 ? MSG_MINE : 0, 1700000000000LL + (int64_t)i);
+    }
+    double ns = elapsed_ns(start);
+    history_trim(history);
+    bench_report("layout", count, count, ns);
+}
+
+// The visible list at random scroll positions, one frame each
+void bench_draw_list(MessageHistory& history, size_t count, size_t frames) {
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> position(0, std::max(0, history.height - VIEW_HEIGHT));
+    std::vector<VisibleMessage> visible;
+    size_t shown = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames; f++) {
+        int view_top = position(random);
+        history_visible(history, view_top, view_top + VIEW_HEIGHT, visible);
+        shown += visible.size();
+        history.frame++;
+    }
+    double ns = elapsed_ns(start);
+    if (shown == 0 && count > 0) std::cerr << "Draw list came out empty" << std::endl;
+    bench_report("draw_list", count, frames, ns);
+}
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [-n history sizes, comma separated] [-r ring messages]"
+              << " [-f frames per size] [-o output file]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    options.ring_messages = 1000000;
+    options.frames = 2000;
+    const char* sizes = "1000,100000,1000000";
+    int option;
+    while ((option = getopt(argc, argv, "n:r:f:o:h")) != -1) {
+        switch (option) {
+            case 'n': sizes = optarg; break;
+            case 'r': options.ring_messages = strtoull(optarg, NULL, 10); break;
+            case 'f': options.frames = strtoull(optarg, NULL, 10); break;
+            case 'o':
+                bench_out = fopen(optarg, "w");
+                if (bench_out == NULL) {
+                    std::cerr << "Failed to open " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    for (const char* size = sizes; *size != '\0';) {
+        char* end;
+        options.sizes.push_back(strtoull(size, &end, 10));
+        if (end == size || (*end != ',' && *end != '\0')) {
+            usage(argv[0]);
+            return 1;
+        }
+        size = *end == ',' ? end + 1 : end;
+    }
+
+    // Messages from user0 count as our own. chat_archive is never opened, so
+    // parsing does not queue records for the archive log.
+    my_username = "user0";
+    my_client_id = (uint32_t)getpid();
+    bench_init_texts();
+
+    bench_parse(options.ring_messages);
+    bench_ring(options.ring_messages);
+    for (size_t i = 0; i < options.sizes.size(); i++) {
+        size_t count = options.sizes[i];
+        bench_ingest(count);
+        MessageHistory history;
+        bench_layout(history, count);
+        bench_draw_list(history, count, options.frames);
+        history_free(history);
+    }
+    history_free(chat_messages);
+
+    if (bench_out != stdout) fclose(bench_out);
+    return 0;
+}
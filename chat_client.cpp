@@ -0,0 +1,3078 @@
+#include "chat_client_internal.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <time.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <cerrno>
+#include <zlib.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+int message_height(uint32_t flags) {
+    return (flags & MSG_MINE) ? MINE_HEIGHT : THEIRS_HEIGHT;
+}
+
+int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic microseconds, for frame budgets
+int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Wall clock microseconds, comparable between processes, for latencies
+int64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Per user file in the working directory, prefix + username + extension,
+// with anything but letters and digits in the name replaced; the
+// environment variable overrides it
+std::string user_file_path(const char* variable, const char* prefix, const std::string& username, const char* extension) {
+    const char* path = getenv(variable);
+    if (path != NULL) return path;
+
+    std::string name = prefix;
+    for (size_t i = 0; i < username.size(); i++) {
+        name += isalnum((unsigned char)username[i]) ? username[i] : '_';
+    }
+    return name + extension;
+}
+
+std::atomic<bool> trace_enabled(false);
+std::mutex trace_lock;                          // Guards trace_buffers
+std::vector<TraceBuffer*> trace_buffers;        // Live for the whole process
+thread_local TraceBuffer* trace_local = NULL;
+thread_local const char* trace_local_name = NULL;
+
+// This thread's buffer, allocated and registered by its first recorded span
+// so threads never allocate one while tracing is off
+TraceBuffer* trace_buffer() {
+    if (trace_local == NULL) {
+        trace_local = new TraceBuffer();
+        trace_local->tid = (uint32_t)syscall(SYS_gettid);
+        trace_local->thread_name = trace_local_name;
+        trace_local->count = 0;
+        std::lock_guard<std::mutex> guard(trace_lock);
+        trace_buffers.push_back(trace_local);
+    }
+    return trace_local;
+}
+
+TraceSpan::TraceSpan(const char* span_name) {
+    name = span_name;
+    start_us = trace_enabled.load(std::memory_order_relaxed) ? now_us() : 0;
+}
+
+TraceSpan::~TraceSpan() {
+    if (start_us != 0) trace_record(name, start_us);
+}
+
+// Record a span from start_us to now, for phases that are not one scope
+void trace_record(const char* name, int64_t start_us) {
+    TraceBuffer* buffer = trace_buffer();
+    uint64_t count = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[count % TRACE_EVENTS];
+    event.name = name;
+    event.start_us = start_us;
+    event.duration_us = now_us() - start_us;
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// Name the calling thread in dumps
+void trace_thread_name(const char* name) {
+    trace_local_name = name;
+    if (trace_local != NULL) trace_local->thread_name = name;
+}
+
+// Events of threads still recording may be overwritten while they are
+// copied; a dump taken mid-run can show a few torn spans near the wrap point
+bool trace_dump(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Failed to write trace " << path << std::endl;
+        return false;
+    }
+
+    std::vector<TraceBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        buffers = trace_buffers;
+    }
+    int pid = (int)getpid();
+    bool first = true;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t b = 0; b < buffers.size(); b++) {
+        TraceBuffer& buffer = *buffers[b];
+        if (buffer.thread_name != NULL) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", pid, buffer.tid, buffer.thread_name);
+            first = false;
+        }
+        uint64_t count = buffer.count.load(std::memory_order_acquire);
+        uint64_t begin = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+        for (uint64_t i = begin; i < count; i++) {
+            const TraceEvent& event = buffer.events[i % TRACE_EVENTS];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%lld,\"dur\":%lld}",
+                    first ? "" : ",\n", event.name, pid, buffer.tid, (long long)event.start_us,
+                    (long long)event.duration_us);
+            first = false;
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
+
+void history_init(MessageHistory& history) {
+    const char* budget_mb = getenv("CHAT_HISTORY_MB");
+    size_t mb = budget_mb != NULL ? (size_t)atol(budget_mb) : DEFAULT_HISTORY_MB;
+    if (mb == 0) mb = DEFAULT_HISTORY_MB;
+
+    history.count = 0;
+    history.height = 0;
+    history.read_y = 0;
+    history.budget = mb * 1024 * 1024;
+    history.resident_bytes = 0;
+    history.spill = NULL;
+    history.mapping = NULL;
+    history.mapping_size = 0;
+    history.frame = 0;
+    history.hold_blocks = false;
+}
+
+// Release every block, index and the snapshot mapping and close the spill
+// file. The history is left empty; history_init makes it usable again.
+void history_free(MessageHistory& history) {
+    for (size_t i = 0; i < history.pages.size(); i++) {
+        HistoryPage& page = history.pages[i];
+        if (!page.mapped) {
+            free(page.text);
+            free(page.index->columns);
+        }
+        delete page.index;
+    }
+    for (size_t i = 0; i < history.free_blocks.size(); i++) free(history.free_blocks[i]);
+    for (size_t i = 0; i < history.retired_columns.size(); i++) free(history.retired_columns[i]);
+    if (history.spill != NULL) fclose(history.spill);
+    if (history.mapping != NULL) munmap(history.mapping, history.mapping_size);
+    history = MessageHistory();
+}
+
+uint32_t history_sender_id(MessageHistory& history, const char* name, size_t length) {
+    std::string sender(name, length);
+    std::unordered_map<std::string, uint32_t>::iterator found = history.sender_ids.find(sender);
+    if (found != history.sender_ids.end()) return found->second;
+
+    uint32_t id = (uint32_t)history.senders.size();
+    history.senders.push_back(sender);
+    history.sender_ids[sender] = id;
+    return id;
+}
+
+const char* history_sender(const MessageHistory& history, const HistoryPage& page, uint32_t k) {
+    return history.senders[page.index->sender_ids[k]].c_str();
+}
+
+const char* history_text(const HistoryPage& page, uint32_t k) {
+    return page.text + page.index->text_offsets[k];
+}
+
+char* history_alloc_block(MessageHistory& history) {
+    history.resident_bytes += PAGE_TEXT_BYTES;
+    if (history.free_blocks.empty()) return (char*)malloc(PAGE_TEXT_BYTES);
+
+    char* block = history.free_blocks.back();
+    history.free_blocks.pop_back();
+    return block;
+}
+
+void history_release_block(MessageHistory& history, HistoryPage& page) {
+    history.free_blocks.push_back(page.text);
+    page.text = NULL;
+    history.resident_bytes -= PAGE_TEXT_BYTES;
+}
+
+// Index bytes per message
+size_t page_index_bytes(uint32_t capacity) {
+    return (size_t)capacity * (sizeof(int64_t) + 5 * sizeof(uint32_t) + sizeof(uint16_t));
+}
+
+// Point the columns into memory laid out for capacity entries, widest first
+// so every column stays aligned
+void page_index_place(PageIndex& index, char* memory, uint32_t capacity) {
+    index.timestamps = (int64_t*)memory;
+    index.sender_ids = (uint32_t*)(index.timestamps + capacity);
+    index.flags = index.sender_ids + capacity;
+    index.y_offsets = (int32_t*)(index.flags + capacity);
+    index.text_offsets = (uint32_t*)(index.y_offsets + capacity);
+    index.text_lengths = index.text_offsets + capacity;
+    index.heights = (uint16_t*)(index.text_lengths + capacity);
+    index.capacity = capacity;
+}
+
+// Move a page's index into an allocation of capacity entries. Columns a
+// running scan may read are kept until the scan releases the history.
+void page_index_resize(MessageHistory& history, HistoryPage& page, uint32_t capacity) {
+    PageIndex& index = *page.index;
+    if (index.columns != NULL && index.capacity == capacity) return;
+    PageIndex resized;
+    resized.columns = (char*)malloc(page_index_bytes(capacity));
+    page_index_place(resized, resized.columns, capacity);
+    if (index.columns != NULL) {
+        memcpy(resized.timestamps, index.timestamps, page.count * sizeof(int64_t));
+        memcpy(resized.sender_ids, index.sender_ids, page.count * sizeof(uint32_t));
+        memcpy(resized.flags, index.flags, page.count * sizeof(uint32_t));
+        memcpy(resized.y_offsets, index.y_offsets, page.count * sizeof(int32_t));
+        memcpy(resized.text_offsets, index.text_offsets, page.count * sizeof(uint32_t));
+        memcpy(resized.text_lengths, index.text_lengths, page.count * sizeof(uint32_t));
+        memcpy(resized.heights, index.heights, page.count * sizeof(uint16_t));
+        if (history.hold_blocks) history.retired_columns.push_back(index.columns);
+        else free(index.columns);
+        history.resident_bytes -= page_index_bytes(index.capacity);
+    }
+    index = resized;
+    history.resident_bytes += page_index_bytes(capacity);
+}
+
+bool history_spill_page(MessageHistory& history, HistoryPage& page) {
+    if (history.spill == NULL) {
+        history.spill = tmpfile();
+        if (history.spill == NULL) {
+            std::cerr << "Failed to create history spill file" << std::endl;
+            return false;
+        }
+    }
+
+    fseek(history.spill, 0, SEEK_END);
+    long offset = ftell(history.spill);
+    if (fwrite(page.text, 1, page.text_used, history.spill) != page.text_used || fflush(history.spill) != 0) {
+        std::cerr << "Failed to write history spill file" << std::endl;
+        return false;
+    }
+
+    page.spill_offset = offset;
+    return true;
+}
+
+// Release least recently used blocks until the history fits its budget. The
+// tail page is still being filled and pages drawn this frame stay resident.
+void history_trim(MessageHistory& history) {
+    while (history.resident_bytes > history.budget && !history.hold_blocks) {
+        HistoryPage* victim = NULL;
+        for (size_t i = 0; i + 1 < history.pages.size(); i++) {
+            HistoryPage& page = history.pages[i];
+            if (page.text == NULL || page.mapped || page.last_used == history.frame) continue;
+            if (victim == NULL || page.last_used < victim->last_used) victim = &page;
+        }
+        if (victim == NULL) return;
+
+        // Blocks are immutable once full, so a block that was read back in
+        // is already on disk and only has to be dropped
+        if (victim->spill_offset == -1 && !history_spill_page(history, *victim)) return;
+        history_release_block(history, *victim);
+    }
+
+    if (!history.hold_blocks) {
+        for (size_t i = 0; i < history.retired_columns.size(); i++) free(history.retired_columns[i]);
+        history.retired_columns.clear();
+    }
+
+    // Keep a couple of spare blocks for the next pages instead of the heap
+    while (history.free_blocks.size() > 2) {
+        free(history.free_blocks.back());
+        history.free_blocks.pop_back();
+    }
+}
+
+// Make a page's text resident, reading it back from the spill file if needed
+HistoryPage& history_load_page(MessageHistory& history, size_t index) {
+    HistoryPage& page = history.pages[index];
+    page.last_used = history.frame;
+    if (page.text != NULL) return page;
+
+    page.text = history_alloc_block(history);
+    fseek(history.spill, page.spill_offset, SEEK_SET);
+    if (fread(page.text, 1, page.text_used, history.spill) != page.text_used) {
+        std::cerr << "Failed to read history spill file" << std::endl;
+        memset(page.text, 0, page.text_used);
+    }
+
+    history_trim(history);
+    return page;
+}
+
+// Append a message: the text is copied into the tail arena block and one
+// entry is added to each index column. Only opening a new page allocates.
+// Returns the message's history index. Does not enforce the memory budget;
+// see history_push.
+size_t history_append(MessageHistory& history, const char* sender, size_t sender_length,
+                      const char* text, size_t text_length, uint32_t flags, int64_t timestamp) {
+    if (text_length > PAGE_TEXT_BYTES - 1) text_length = PAGE_TEXT_BYTES - 1;
+
+    if (history.pages.empty() || history.pages.back().mapped || history.pages.back().count == PAGE_MESSAGES ||
+        history.pages.back().text_used + text_length + 1 > PAGE_TEXT_BYTES) {
+        if (!history.pages.empty() && !history.pages.back().mapped) {
+            page_index_resize(history, history.pages.back(), history.pages.back().count);
+        }
+
+        HistoryPage page;
+        page.index = new PageIndex;
+        page.index->columns = NULL;
+        page.count = 0;
+        page.text = history_alloc_block(history);
+        page.text_used = 0;
+        page.first = history.count;
+        page.y = history.height;
+        page.height = 0;
+        page.spill_offset = -1;
+        page.last_used = history.frame;
+        page.mapped = false;
+        history.pages.push_back(page);
+        page_index_resize(history, history.pages.back(), PAGE_INDEX_INITIAL);
+    }
+
+    HistoryPage& page = history.pages.back();
+    if (page.count == page.index->capacity) {
+        page_index_resize(history, page, std::min(2 * page.index->capacity, (uint32_t)PAGE_MESSAGES));
+    }
+    PageIndex& index = *page.index;
+    uint32_t k = page.count++;
+    int height = message_height(flags);
+
+    index.sender_ids[k] = history_sender_id(history, sender, sender_length);
+    index.flags[k] = flags;
+    index.timestamps[k] = timestamp;
+    index.y_offsets[k] = page.height;
+    index.heights[k] = (uint16_t)height;
+    index.text_offsets[k] = page.text_used;
+    index.text_lengths[k] = (uint32_t)text_length;
+
+    memcpy(page.text + page.text_used, text, text_length);
+    page.text[page.text_used + text_length] = '\0';
+    page.text_used += (uint32_t)text_length + 1;
+
+    page.height += height;
+    history.height += height;
+    history.count++;
+    return history.count - 1;
+}
+
+size_t history_push(MessageHistory& history, const char* sender, size_t sender_length,
+                  const char* text, size_t text_length, uint32_t flags) {
+    size_t index = history_append(history, sender, sender_length, text, text_length, flags, now_ms());
+    history_trim(history);
+    return index;
+}
+
+// Page containing list position y (clamped to the first/last page)
+size_t history_page_at(const MessageHistory& history, int y) {
+    size_t lo = 0, hi = history.pages.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (history.pages[mid].y <= y) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// First message of the page whose bubble reaches below local position y
+uint32_t page_message_at(const HistoryPage& page, int y) {
+    const int32_t* first = page.index->y_offsets;
+    const int32_t* found = std::upper_bound(first, first + page.count, y);
+    return found == first ? 0 : (uint32_t)(found - first - 1);
+}
+
+// Messages from others positioned below list position y
+size_t history_count_below(const MessageHistory& history, int y) {
+    size_t count = 0;
+    for (size_t p = history.pages.size(); p-- > 0;) {
+        const HistoryPage& page = history.pages[p];
+        if (page.y + page.height <= y) break;
+
+        const PageIndex& index = *page.index;
+        int local = y - page.y;
+        for (uint32_t k = 0; k < page.count; k++) {
+            count += (index.y_offsets[k] >= local) & ((index.flags[k] & MSG_MINE) == 0);
+        }
+    }
+    return count;
+}
+
+// The messages between list positions view_top and view_bottom. The first
+// visible page and message are found by binary search over the y index;
+// pages outside the view are never read back from the spill file.
+void history_visible(MessageHistory& history, int view_top, int view_bottom, std::vector<VisibleMessage>& out) {
+    out.clear();
+    for (size_t p = history_page_at(history, view_top); p < history.pages.size(); p++) {
+        if (history.pages[p].y > view_bottom) break;
+
+        HistoryPage& page = history_load_page(history, p);
+        const PageIndex& index = *page.index;
+        for (uint32_t j = page_message_at(page, view_top - page.y); j < page.count; j++) {
+            int y = page.y + index.y_offsets[j];
+            if (y > view_bottom) break;
+
+            VisibleMessage visible = { page.first + j, y, history_sender(history, page, j), history_text(page, j),
+                                       index.flags[j] };
+            out.push_back(visible);
+        }
+    }
+}
+
+// Page and slot of a history index
+bool history_locate(const MessageHistory& history, size_t message, size_t* page_out, uint32_t* slot_out) {
+    if (message >= history.count) return false;
+
+    size_t lo = 0, hi = history.pages.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (history.pages[mid].first <= message) lo = mid;
+        else hi = mid;
+    }
+    *page_out = lo;
+    *slot_out = (uint32_t)(message - history.pages[lo].first);
+    return true;
+}
+
+// Appends the history index of every message sent by sender_id to out
+void history_scan_sender(const MessageHistory& history, uint32_t sender_id, std::vector<size_t>& out) {
+    for (size_t p = 0; p < history.pages.size(); p++) {
+        const HistoryPage& page = history.pages[p];
+        const uint32_t* ids = page.index->sender_ids;
+        for (uint32_t k = 0; k < page.count; k++) {
+            if (ids[k] == sender_id) out.push_back(page.first + k);
+        }
+    }
+}
+
+// History snapshot: written on exit and mapped on the next start, so the
+// first frame costs the same whatever the history size. The file holds the
+// page table, then each page's index columns packed to its message count and
+// its text block, then the sender table. Pending sends are not saved. Only
+// the page table and senders are read at load; everything else is touched
+// when drawn, searched or backfilled.
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t index_size;        // Index bytes per message, rejects a changed layout
+    uint32_t page_count;
+    uint32_t sender_count;
+    uint32_t reserved;
+    uint64_t senders_offset;
+    uint64_t ring_next;         // Ring position the history is complete up to
+};
+
+struct SnapshotPage {
+    uint64_t index_offset;
+    uint64_t text_offset;
+    uint32_t count;
+    uint32_t text_used;
+    int32_t height;
+    uint32_t reserved;
+};
+
+std::string snapshot_path(const std::string& username) {
+    return user_file_path("CHAT_SNAPSHOT", "chat_history_", username, ".snap");
+}
+
+// Pad the file to the next 8 byte boundary so mapped indexes stay aligned
+long snapshot_align(FILE* file) {
+    static const char zeros[8] = { 0 };
+    long offset = ftell(file);
+    if (offset % 8 != 0) {
+        fwrite(zeros, 1, 8 - offset % 8, file);
+        offset += 8 - offset % 8;
+    }
+    return offset;
+}
+
+// Write one page's index columns and text block, leaving out our own sends
+// still pending: the outbox replays the ones never published and catch-up
+// brings back the ones that were, so a restored copy would show twice and
+// never be confirmed
+void snapshot_write_page(FILE* file, const HistoryPage& page, const char* text, SnapshotPage& entry) {
+    const PageIndex& index = *page.index;
+    std::vector<char> memory(page_index_bytes(page.count));
+    PageIndex kept;
+    page_index_place(kept, memory.data(), page.count);
+    std::vector<char> kept_text;
+    kept_text.reserve(page.text_used);
+
+    uint32_t count = 0;
+    int height = 0;
+    for (uint32_t k = 0; k < page.count; k++) {
+        if (index.flags[k] & MSG_PENDING) continue;
+        kept.timestamps[count] = index.timestamps[k];
+        kept.sender_ids[count] = index.sender_ids[k];
+        kept.flags[count] = index.flags[k];
+        kept.y_offsets[count] = height;
+        kept.text_offsets[count] = (uint32_t)kept_text.size();
+        kept.text_lengths[count] = index.text_lengths[k];
+        kept.heights[count] = index.heights[k];
+        const char* message = text + index.text_offsets[k];
+        kept_text.insert(kept_text.end(), message, message + index.text_lengths[k] + 1);
+        height += index.heights[k];
+        count++;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.count = count;
+    entry.text_used = (uint32_t)kept_text.size();
+    entry.height = height;
+
+    entry.index_offset = snapshot_align(file);
+    fwrite(kept.timestamps, sizeof(int64_t), count, file);
+    fwrite(kept.sender_ids, sizeof(uint32_t), count, file);
+    fwrite(kept.flags, sizeof(uint32_t), count, file);
+    fwrite(kept.y_offsets, sizeof(int32_t), count, file);
+    fwrite(kept.text_offsets, sizeof(uint32_t), count, file);
+    fwrite(kept.text_lengths, sizeof(uint32_t), count, file);
+    fwrite(kept.heights, sizeof(uint16_t), count, file);
+    entry.text_offset = snapshot_align(file);
+    if (!kept_text.empty()) fwrite(kept_text.data(), 1, kept_text.size(), file);
+}
+
+bool history_save_snapshot(const MessageHistory& history, const std::string& path, uint64_t ring_next) {
+    std::string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == NULL) {
+        std::cerr << "Failed to write history snapshot " << temp << std::endl;
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.index_size = (uint32_t)page_index_bytes(1);
+    header.page_count = (uint32_t)history.pages.size();
+    header.sender_count = (uint32_t)history.senders.size();
+    header.ring_next = ring_next;
+
+    // Header and page table are rewritten once the offsets are known
+    std::vector<SnapshotPage> table(history.pages.size());
+    fwrite(&header, sizeof(header), 1, file);
+    if (!table.empty()) fwrite(&table[0], sizeof(SnapshotPage), table.size(), file);
+
+    // Spilled blocks are streamed through one buffer rather than loaded, so
+    // saving does not pull the whole history back into memory
+    std::vector<char> scratch(PAGE_TEXT_BYTES);
+    for (size_t p = 0; p < history.pages.size(); p++) {
+        const HistoryPage& page = history.pages[p];
+        const char* text = page.text;
+        if (text == NULL) {
+            if (pread(fileno(history.spill), scratch.data(), page.text_used, page.spill_offset) !=
+                (ssize_t)page.text_used) {
+                std::cerr << "Failed to read history spill file" << std::endl;
+                fclose(file);
+                unlink(temp.c_str());
+                return false;
+            }
+            text = scratch.data();
+        }
+        snapshot_write_page(file, page, text, table[p]);
+    }
+
+    header.senders_offset = snapshot_align(file);
+    for (size_t i = 0; i < history.senders.size(); i++) {
+        uint32_t length = (uint32_t)history.senders[i].size();
+        fwrite(&length, sizeof(length), 1, file);
+        fwrite(history.senders[i].data(), 1, length, file);
+    }
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    if (!table.empty()) fwrite(&table[0], sizeof(SnapshotPage), table.size(), file);
+
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write history snapshot " << path << std::endl;
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Map a snapshot into an empty history. The mapping stays until
+// history_free; saving replaces the file by rename, so it is never truncated
+// underneath the mapped pages.
+bool history_load_snapshot(MessageHistory& history, const std::string& path, uint64_t* ring_next) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(SnapshotHeader)) {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char* data = (const char*)map;
+    size_t size = info.st_size;
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    const SnapshotPage* table = (const SnapshotPage*)(data + sizeof(SnapshotHeader));
+
+    bool valid = header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION &&
+                 header->index_size == page_index_bytes(1) &&
+                 sizeof(SnapshotHeader) + (uint64_t)header->page_count * sizeof(SnapshotPage) <= size &&
+                 header->senders_offset <= size;
+    for (uint32_t p = 0; valid && p < header->page_count; p++) {
+        const SnapshotPage& entry = table[p];
+        valid = entry.count <= PAGE_MESSAGES && entry.text_used <= PAGE_TEXT_BYTES &&
+                entry.index_offset % 8 == 0 && entry.index_offset + page_index_bytes(entry.count) <= size &&
+                entry.text_offset + entry.text_used <= size;
+    }
+
+    std::vector<std::string> senders;
+    size_t offset = valid ? header->senders_offset : size;
+    for (uint32_t i = 0; valid && i < header->sender_count; i++) {
+        uint32_t length;
+        valid = offset + sizeof(length) <= size;
+        if (!valid) break;
+        memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+        valid = offset + length <= size;
+        if (valid) senders.push_back(std::string(data + offset, length));
+        offset += length;
+    }
+
+    if (!valid) {
+        std::cerr << "Ignoring invalid history snapshot " << path << std::endl;
+        munmap(map, size);
+        return false;
+    }
+
+    for (size_t i = 0; i < senders.size(); i++) history_sender_id(history, senders[i].c_str(), senders[i].size());
+
+    for (uint32_t p = 0; p < header->page_count; p++) {
+        const SnapshotPage& entry = table[p];
+        if (entry.count == 0) continue;
+
+        HistoryPage page;
+        page.index = new PageIndex;
+        page.index->columns = NULL;
+        page_index_place(*page.index, (char*)(data + entry.index_offset), entry.count);
+        page.count = entry.count;
+        page.text = (char*)(data + entry.text_offset);
+        page.text_used = entry.text_used;
+        page.first = history.count;
+        page.y = history.height;
+        page.height = entry.height;
+        page.spill_offset = -1;
+        page.last_used = history.frame;
+        page.mapped = true;
+        history.pages.push_back(page);
+
+        history.count += entry.count;
+        history.height += entry.height;
+    }
+
+    history.mapping = map;
+    history.mapping_size = size;
+
+    // Restored messages were read in the previous session
+    history.read_y = history.height;
+    *ring_next = header->ring_next;
+    return true;
+}
+
+// Splits text into tokens: runs of ASCII letters/digits and non-ASCII bytes,
+// so UTF-8 words stay whole. ASCII is lowercased.
+void search_tokenize(const char* text, size_t length, std::vector<std::string>& tokens) {
+    std::string token;
+    for (size_t i = 0; i <= length; i++) {
+        unsigned char c = i < length ? (unsigned char)text[i] : ' ';
+        if (c >= 0x80 || isalnum(c)) {
+            token.push_back((char)tolower(c));
+        } else if (!token.empty()) {
+            tokens.push_back(token);
+            token.clear();
+        }
+    }
+}
+
+void search_index_add(SearchIndex& index, size_t message, const char* text, size_t length) {
+    std::vector<std::string> tokens;
+    search_tokenize(text, length, tokens);
+
+    for (size_t i = 0; i < tokens.size(); i++) {
+        std::vector<uint32_t>& list = index.postings[tokens[i]];
+        if (list.empty() || list.back() < (uint32_t)message) {
+            list.push_back((uint32_t)message);
+        } else {
+            // Backfilled message: goes in front of the live ones
+            std::vector<uint32_t>::iterator at = std::lower_bound(list.begin(), list.end(), (uint32_t)message);
+            if (*at != (uint32_t)message) list.insert(at, (uint32_t)message);
+        }
+    }
+    index.indexed++;
+}
+
+// Index restored messages until the deadline (now_us() time). Snapshot
+// pages are mapped, so their text is always addressable.
+void search_index_backfill(SearchIndex& index, const MessageHistory& history, int64_t deadline) {
+    while (index.backfill_next < index.backfill_end && now_us() < deadline) {
+        size_t p;
+        uint32_t k;
+        if (!history_locate(history, index.backfill_next, &p, &k)) break;
+        const HistoryPage& page = history.pages[p];
+        size_t end = std::min(index.backfill_end, index.backfill_next + INGEST_CHECK_EVERY);
+        for (; k < page.count && index.backfill_next < end; k++, index.backfill_next++) {
+            search_index_add(index, index.backfill_next, history_text(page, k), page.index->text_lengths[k]);
+        }
+    }
+}
+
+// Messages containing every word of the query. A "from:name" term restricts
+// the result to one sender using the sender column of the history index.
+void search_query(const SearchIndex& index, const MessageHistory& history, const std::string& query,
+                  std::vector<uint32_t>& out) {
+    out.clear();
+
+    std::vector<std::string> words;
+    std::vector<const std::vector<uint32_t>*> lists;
+    std::vector<uint32_t> from_list;
+    std::string rest;
+
+    size_t start = 0;
+    while (start < query.size()) {
+        size_t end = query.find(' ', start);
+        if (end == std::string::npos) end = query.size();
+        std::string term = query.substr(start, end - start);
+        start = end + 1;
+
+        if (term.compare(0, 5, "from:") == 0 && term.size() > 5) {
+            std::unordered_map<std::string, uint32_t>::const_iterator sender = history.sender_ids.find(term.substr(5));
+            if (sender == history.sender_ids.end()) return;
+
+            std::vector<size_t> found;
+            history_scan_sender(history, sender->second, found);
+            from_list.assign(found.begin(), found.end());
+            lists.push_back(&from_list);
+        } else {
+            rest += term + " ";
+        }
+    }
+
+    search_tokenize(rest.c_str(), rest.size(), words);
+    for (size_t i = 0; i < words.size(); i++) {
+        std::unordered_map<std::string, std::vector<uint32_t> >::const_iterator found = index.postings.find(words[i]);
+        if (found == index.postings.end()) return;
+        lists.push_back(&found->second);
+    }
+    if (lists.empty()) return;
+
+    // Walk the shortest list and binary search the others
+    size_t shortest = 0;
+    for (size_t i = 1; i < lists.size(); i++) {
+        if (lists[i]->size() < lists[shortest]->size()) shortest = i;
+    }
+
+    std::vector<std::vector<uint32_t>::const_iterator> cursors;
+    for (size_t i = 0; i < lists.size(); i++) cursors.push_back(lists[i]->begin());
+
+    const std::vector<uint32_t>& base = *lists[shortest];
+    for (size_t j = 0; j < base.size(); j++) {
+        bool all = true;
+        for (size_t i = 0; i < lists.size() && all; i++) {
+            if (i == shortest) continue;
+            cursors[i] = std::lower_bound(cursors[i], lists[i]->end(), base[j]);
+            all = cursors[i] != lists[i]->end() && *cursors[i] == base[j];
+        }
+        if (all) out.push_back(base[j]);
+    }
+}
+
+void pool_run(ThreadPool* pool) {
+    trace_thread_name("pool");
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            while (pool->tasks.empty() && !pool->stopping) pool->wake.wait(guard);
+            if (pool->tasks.empty()) return;
+            task.swap(pool->tasks.front().run);
+            pool->tasks.pop_front();
+        }
+        TRACE_SPAN("pool task");
+        task();
+    }
+}
+
+void pool_start(ThreadPool& pool) {
+    unsigned int threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    if (threads > 8) threads = 8;
+
+    pool.stopping = false;
+    for (unsigned int i = 0; i < threads; i++) pool.threads.push_back(std::thread(pool_run, &pool));
+}
+
+void pool_submit(ThreadPool& pool, const std::function<void()>& task, const void* owner) {
+    PoolTask queued = { owner, task };
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.tasks.push_back(queued);
+    }
+    pool.wake.notify_one();
+}
+
+// Drop the owner's tasks that have not started. Returns how many.
+size_t pool_cancel(ThreadPool& pool, const void* owner) {
+    std::lock_guard<std::mutex> guard(pool.lock);
+    size_t before = pool.tasks.size();
+    for (std::deque<PoolTask>::iterator it = pool.tasks.begin(); it != pool.tasks.end();) {
+        if (it->owner == owner) it = pool.tasks.erase(it);
+        else ++it;
+    }
+    return before - pool.tasks.size();
+}
+
+void pool_stop(ThreadPool& pool) {
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (size_t i = 0; i < pool.threads.size(); i++) pool.threads[i].join();
+    pool.threads.clear();
+}
+
+ThreadPool worker_pool;
+
+// Offsets where the needle's first and last bytes both match, either case
+typedef void (*ScanCandidatesFn)(const char* text, size_t length, const std::string& needle, std::vector<uint32_t>& out);
+
+void scan_candidates_scalar(const char* text, size_t length, const std::string& needle, std::vector<uint32_t>& out) {
+    size_t last = needle.size() - 1;
+    for (size_t i = 0; i + last < length; i++) {
+        if ((char)tolower((unsigned char)text[i]) == needle[0] && (char)tolower((unsigned char)text[i + last]) == needle[last]) {
+            out.push_back((uint32_t)i);
+        }
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+void scan_candidates_sse2(const char* text, size_t length, const std::string& needle, std::vector<uint32_t>& out) {
+    size_t last = needle.size() - 1;
+    const __m128i first_lo = _mm_set1_epi8(needle[0]), first_up = _mm_set1_epi8((char)toupper((unsigned char)needle[0]));
+    const __m128i last_lo = _mm_set1_epi8(needle[last]), last_up = _mm_set1_epi8((char)toupper((unsigned char)needle[last]));
+
+    size_t i = 0;
+    for (; i + last + 16 <= length; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i tail = _mm_loadu_si128((const __m128i*)(text + i + last));
+        __m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(head, first_lo), _mm_cmpeq_epi8(head, first_up));
+        __m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(tail, last_lo), _mm_cmpeq_epi8(tail, last_up));
+
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+        while (mask != 0) {
+            out.push_back((uint32_t)(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+    std::vector<uint32_t>::size_type before = out.size();
+    scan_candidates_scalar(text + i, length - i, needle, out);
+    for (std::vector<uint32_t>::size_type j = before; j < out.size(); j++) out[j] += (uint32_t)i;
+}
+
+__attribute__((target("avx2")))
+void scan_candidates_avx2(const char* text, size_t length, const std::string& needle, std::vector<uint32_t>& out) {
+    size_t last = needle.size() - 1;
+    const __m256i first_lo = _mm256_set1_epi8(needle[0]), first_up = _mm256_set1_epi8((char)toupper((unsigned char)needle[0]));
+    const __m256i last_lo = _mm256_set1_epi8(needle[last]), last_up = _mm256_set1_epi8((char)toupper((unsigned char)needle[last]));
+
+    size_t i = 0;
+    for (; i + last + 32 <= length; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i*)(text + i + last));
+        __m256i eq_first = _mm256_or_si256(_mm256_cmpeq_epi8(head, first_lo), _mm256_cmpeq_epi8(head, first_up));
+        __m256i eq_last = _mm256_or_si256(_mm256_cmpeq_epi8(tail, last_lo), _mm256_cmpeq_epi8(tail, last_up));
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+        while (mask != 0) {
+            out.push_back((uint32_t)(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+    std::vector<uint32_t>::size_type before = out.size();
+    scan_candidates_scalar(text + i, length - i, needle, out);
+    for (std::vector<uint32_t>::size_type j = before; j < out.size(); j++) out[j] += (uint32_t)i;
+}
+#endif
+
+ScanCandidatesFn scan_candidates_impl() {
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_candidates_avx2;
+    return scan_candidates_sse2;
+#else
+    return scan_candidates_scalar;
+#endif
+}
+
+ScanCandidatesFn scan_candidates = scan_candidates_impl();
+
+// Matching message slots of one block, in order, each reported once
+void scan_block(const char* text, const ScanPage& page, const std::string& needle,
+                std::vector<uint32_t>& candidates, std::vector<uint32_t>& out) {
+    candidates.clear();
+    scan_candidates(text, page.text_used, needle, candidates);
+
+    uint32_t next_message = 0;   // Matches before this offset belong to a reported message
+    for (size_t c = 0; c < candidates.size(); c++) {
+        uint32_t pos = candidates[c];
+        if (pos < next_message) continue;
+
+        size_t k = 1;
+        while (k + 1 < needle.size() && (char)tolower((unsigned char)text[pos + k]) == needle[k]) k++;
+        if (k + 1 < needle.size()) continue;
+
+        // NUL separators keep matches inside one message
+        const uint32_t* slot = std::upper_bound(page.text_offsets, page.text_offsets + page.count, pos) - 1;
+        uint32_t index = (uint32_t)(slot - page.text_offsets);
+        if (index >= page.count) continue;
+        out.push_back((uint32_t)(page.first + index));
+        next_message = index + 1 < page.count ? page.text_offsets[index + 1] : page.text_used;
+    }
+}
+
+void scan_worker(SubstringScan* scan) {
+    std::vector<char> buffer(PAGE_TEXT_BYTES);
+    std::vector<uint32_t> candidates, matches;
+
+    while (!scan->cancel.load(std::memory_order_relaxed)) {
+        size_t p = scan->next_page.fetch_add(1);
+        if (p >= scan->pages.size()) break;
+
+        const ScanPage& page = scan->pages[p];
+        const char* text = page.text;
+        if (text == NULL) {
+            ssize_t got = pread(scan->spill_fd, buffer.data(), page.text_used, page.spill_offset);
+            if (got != (ssize_t)page.text_used) continue;
+            text = buffer.data();
+        }
+
+        matches.clear();
+        scan_block(text, page, scan->needle, candidates, matches);
+        if (!matches.empty()) {
+            std::lock_guard<std::mutex> guard(scan->lock);
+            scan->found.insert(scan->found.end(), matches.begin(), matches.end());
+        }
+    }
+
+    scan->running.fetch_sub(1);
+}
+
+// Wait for the workers to finish, returning the held history blocks
+void scan_release(SubstringScan& scan, MessageHistory& history) {
+    while (scan.running > 0) std::this_thread::yield();
+    if (scan.holding) {
+        scan.holding = false;
+        history.hold_blocks = false;
+        history_trim(history);
+    }
+}
+
+// Workers still queued are dropped rather than waited for
+void scan_stop(SubstringScan& scan, MessageHistory& history) {
+    scan.cancel = true;
+    scan.running -= (int)pool_cancel(worker_pool, &scan);
+    scan_release(scan, history);
+    scan.found.clear();
+}
+
+ScanPage scan_page(const HistoryPage& page) {
+    ScanPage snapshot;
+    snapshot.text = page.text;
+    snapshot.spill_offset = page.spill_offset;
+    snapshot.text_used = page.text_used;
+    snapshot.text_offsets = page.index->text_offsets;
+    snapshot.count = page.count;
+    snapshot.first = page.first;
+    return snapshot;
+}
+
+void scan_start(SubstringScan& scan, MessageHistory& history, const std::string& query) {
+    scan_stop(scan, history);
+
+    scan.needle.clear();
+    for (size_t i = 0; i < query.size(); i++) scan.needle.push_back((char)tolower((unsigned char)query[i]));
+    scan.scanned = history.count;
+    scan.pages.clear();
+    if (scan.needle.empty()) return;
+
+    for (size_t p = 0; p < history.pages.size(); p++) {
+        scan.pages.push_back(scan_page(history.pages[p]));
+    }
+    scan.spill_fd = history.spill != NULL ? fileno(history.spill) : -1;
+
+    // Resident blocks must not be recycled while workers read them
+    history.hold_blocks = true;
+    scan.holding = true;
+    scan.cancel = false;
+    scan.next_page = 0;
+
+    SubstringScan* shared = &scan;
+    scan.running = (int)worker_pool.threads.size();
+    for (size_t i = 0; i < worker_pool.threads.size(); i++) {
+        pool_submit(worker_pool, [shared]() { scan_worker(shared); }, shared);
+    }
+}
+
+// Merge matches found since the last call into the sorted result. Messages
+// ingested after the scan started are checked here on the UI thread.
+void scan_drain(SubstringScan& scan, MessageHistory& history, std::vector<uint32_t>& matches) {
+    if (scan.needle.empty()) return;
+
+    std::vector<uint32_t> fresh;
+    {
+        std::lock_guard<std::mutex> guard(scan.lock);
+        fresh.swap(scan.found);
+    }
+
+    if (scan.running == 0) scan_release(scan, history);
+
+    if (scan.scanned < history.count) {
+        std::vector<uint32_t> candidates;
+        size_t page_index;
+        uint32_t slot;
+        history_locate(history, scan.scanned, &page_index, &slot);
+        for (size_t p = page_index; p < history.pages.size(); p++) {
+            HistoryPage& page = history_load_page(history, p);
+            ScanPage snapshot = scan_page(page);
+            std::vector<uint32_t> block_matches;
+            scan_block(page.text, snapshot, scan.needle, candidates, block_matches);
+            for (size_t m = 0; m < block_matches.size(); m++) {
+                if (block_matches[m] >= scan.scanned) fresh.push_back(block_matches[m]);
+            }
+        }
+        scan.scanned = history.count;
+    }
+
+    if (fresh.empty()) return;
+    std::sort(fresh.begin(), fresh.end());
+    size_t middle = matches.size();
+    matches.insert(matches.end(), fresh.begin(), fresh.end());
+    std::inplace_merge(matches.begin(), matches.begin() + middle, matches.end());
+}
+
+uint32_t crc32c_table[256];
+
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(HAVE_X86_SIMD)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+    size_t i = 0;
+#if defined(__x86_64__)
+    uint64_t wide = crc;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+#endif
+    for (; i < length; i++) crc = _mm_crc32_u8(crc, bytes[i]);
+    return ~crc;
+}
+#endif
+
+Crc32cFn crc32c_impl() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[n] = c;
+    }
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_sse42;
+#endif
+    return crc32c_software;
+}
+
+Crc32cFn crc32c = crc32c_impl();
+
+// On-disk archive and durable message log: the first process to lock the
+// archive directory becomes the logger and appends every message published
+// on the ring to the active segment file; the others only search it, and try
+// to take over when the logger exits. A segment is closed once it reaches
+// SEGMENT_BYTES. Closing writes a small summary next to it (sequence and time
+// range, sender set, bloom filter of word tokens) so archive searches can skip
+// segments that cannot match without reading them.
+//
+// Closed segments are maintained in the background: segments past the
+// retention period or over the disk cap are deleted, and segments older than
+// the HOT_SEGMENTS newest are rewritten as independently compressed blocks
+// (seg-*.z), dropping expired messages. A block table with each block's time
+// range lets readers decompress only the blocks they need.
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t first_seq;
+};
+
+struct CompressedHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t first_seq;
+    uint32_t block_count;       // BlockEntry table follows the header
+    uint32_t reserved;
+};
+
+struct BlockEntry {
+    uint64_t offset;
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+};
+
+struct SummaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+    uint32_t count;
+    uint32_t senders_bytes;     // NUL separated names, then a BloomHeader and the bloom filter
+};
+
+struct BloomHeader {
+    uint32_t bytes;
+    uint32_t hashes;
+};
+
+uint64_t token_hash(const char* token, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)token[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void bloom_add(std::vector<uint8_t>& bloom, uint32_t hashes, uint64_t hash) {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32);
+    uint32_t bits = (uint32_t)bloom.size() * 8;
+    for (uint32_t i = 0; i < hashes; i++) {
+        uint32_t bit = (h1 + i * h2) % bits;
+        bloom[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+}
+
+bool bloom_test(const std::vector<uint8_t>& bloom, uint32_t hashes, const std::string& token) {
+    if (bloom.empty()) return true;
+    uint64_t hash = token_hash(token.data(), token.size());
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32);
+    uint32_t bits = (uint32_t)bloom.size() * 8;
+    for (uint32_t i = 0; i < hashes; i++) {
+        uint32_t bit = (h1 + i * h2) % bits;
+        if ((bloom[bit / 8] & (1 << (bit % 8))) == 0) return false;
+    }
+    return true;
+}
+
+void summary_reset(SegmentSummary& summary, uint64_t first_seq) {
+    summary.first_seq = first_seq;
+    summary.last_seq = first_seq - 1;
+    summary.min_timestamp = INT64_MAX;
+    summary.max_timestamp = INT64_MIN;
+    summary.count = 0;
+    summary.senders.clear();
+    summary.tokens.clear();
+    summary.bloom.clear();
+    summary.bloom_hashes = BLOOM_HASHES;
+}
+
+void summary_add(SegmentSummary& summary, const ArchiveRecord& record, const char* sender, const char* text) {
+    summary.last_seq = record.seq;
+    if (record.timestamp < summary.min_timestamp) summary.min_timestamp = record.timestamp;
+    if (record.timestamp > summary.max_timestamp) summary.max_timestamp = record.timestamp;
+    summary.count++;
+
+    std::string name(sender, record.sender_length);
+    if (std::find(summary.senders.begin(), summary.senders.end(), name) == summary.senders.end()) {
+        summary.senders.push_back(name);
+    }
+
+    std::vector<std::string> tokens;
+    search_tokenize(text, record.size - record.sender_length, tokens);
+    for (size_t i = 0; i < tokens.size(); i++) summary.tokens.insert(token_hash(tokens[i].data(), tokens[i].size()));
+}
+
+// Segment path without its .log or .z extension
+std::string segment_stem(const std::string& segment_path) {
+    return segment_path.substr(0, segment_path.rfind('.'));
+}
+
+bool segment_compressed(const std::string& segment_path) {
+    return segment_path.compare(segment_path.size() - 2, 2, ".z") == 0;
+}
+
+std::string summary_path(const std::string& segment_path) {
+    return segment_stem(segment_path) + ".sum";
+}
+
+bool summary_write(const SegmentSummary& summary, const std::string& path) {
+    std::string names;
+    for (size_t i = 0; i < summary.senders.size(); i++) {
+        names += summary.senders[i];
+        names.push_back('\0');
+    }
+
+    // The filter gets BLOOM_BITS_PER_TOKEN bits for each distinct token
+    BloomHeader bloom_header;
+    bloom_header.bytes = (uint32_t)std::max((size_t)8, (summary.tokens.size() * BLOOM_BITS_PER_TOKEN + 7) / 8);
+    bloom_header.hashes = BLOOM_HASHES;
+    std::vector<uint8_t> bloom(bloom_header.bytes, 0);
+    for (std::unordered_set<uint64_t>::const_iterator it = summary.tokens.begin(); it != summary.tokens.end(); ++it) {
+        bloom_add(bloom, bloom_header.hashes, *it);
+    }
+
+    SummaryHeader header;
+    header.magic = SUMMARY_MAGIC;
+    header.version = ARCHIVE_VERSION;
+    header.first_seq = summary.first_seq;
+    header.last_seq = summary.last_seq;
+    header.min_timestamp = summary.min_timestamp;
+    header.max_timestamp = summary.max_timestamp;
+    header.count = summary.count;
+    header.senders_bytes = (uint32_t)names.size();
+
+    // Written under a temporary name so a summary is either complete or absent
+    std::string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == NULL) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(names.data(), 1, names.size(), file) == names.size() &&
+              fwrite(&bloom_header, sizeof(bloom_header), 1, file) == 1 &&
+              fwrite(bloom.data(), 1, bloom.size(), file) == bloom.size();
+    ok = (fclose(file) == 0) && ok;
+    return ok && rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool summary_read(SegmentSummary& summary, const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    SummaryHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == SUMMARY_MAGIC &&
+              header.version == ARCHIVE_VERSION;
+    if (ok) {
+        std::vector<char> names(header.senders_bytes);
+        ok = fread(names.data(), 1, names.size(), file) == names.size();
+
+        // A segment cannot hold more tokens than bytes, which bounds its filter
+        BloomHeader bloom_header = { 0, 0 };
+        ok = ok && fread(&bloom_header, sizeof(bloom_header), 1, file) == 1 && bloom_header.bytes > 0 &&
+             bloom_header.bytes <= SEGMENT_BYTES / 8 * BLOOM_BITS_PER_TOKEN && bloom_header.hashes > 0;
+        summary.bloom.assign(ok ? bloom_header.bytes : 0, 0);
+        summary.bloom_hashes = bloom_header.hashes;
+        ok = ok && fread(summary.bloom.data(), 1, summary.bloom.size(), file) == summary.bloom.size();
+        summary.tokens.clear();
+
+        summary.first_seq = header.first_seq;
+        summary.last_seq = header.last_seq;
+        summary.min_timestamp = header.min_timestamp;
+        summary.max_timestamp = header.max_timestamp;
+        summary.count = header.count;
+        summary.senders.clear();
+        for (size_t start = 0; ok && start < names.size();) {
+            size_t end = start;
+            while (end < names.size() && names[end] != '\0') end++;
+            summary.senders.push_back(std::string(&names[start], end - start));
+            start = end + 1;
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// Segment files of an archive directory, oldest first
+std::vector<std::string> archive_segments(const std::string& dir) {
+    std::vector<std::string> paths;
+    DIR* handle = opendir(dir.c_str());
+    if (handle == NULL) return paths;
+
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        std::string name = entry->d_name;
+        if (name.size() > 6 && name.compare(0, 4, "seg-") == 0 &&
+            (name.compare(name.size() - 4, 4, ".log") == 0 || name.compare(name.size() - 2, 2, ".z") == 0)) {
+            paths.push_back(dir + "/" + name);
+        }
+    }
+    closedir(handle);
+
+    // Names carry the zero padded first sequence number, so they sort in
+    // order. A plain segment whose compressed copy was renamed in but which
+    // was not yet deleted sorts right before it and is left out.
+    std::sort(paths.begin(), paths.end());
+    std::vector<std::string> unique;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (i + 1 < paths.size() && segment_stem(paths[i]) == segment_stem(paths[i + 1])) continue;
+        unique.push_back(paths[i]);
+    }
+    return unique;
+}
+
+uint32_t record_crc(const ArchiveRecord& record, const char* bytes) {
+    ArchiveRecord header = record;
+    header.crc = 0;
+    return crc32c(crc32c(0, &header, sizeof(header)), bytes, record.size);
+}
+
+// Append one framed record to out
+void record_encode(std::string& out, uint64_t seq, uint64_t ring_seq, int64_t timestamp,
+                   const char* sender, size_t sender_length, const char* text, size_t text_length) {
+    ArchiveRecord record;
+    record.size = (uint32_t)(sender_length + text_length);
+    record.sender_length = (uint16_t)sender_length;
+    record.flags = 0;
+    record.seq = seq;
+    record.ring_seq = ring_seq;
+    record.timestamp = timestamp;
+    record.crc = 0;
+    record.reserved = 0;
+
+    uint32_t crc = crc32c(0, &record, sizeof(record));
+    crc = crc32c(crc, sender, sender_length);
+    record.crc = crc32c(crc, text, text_length);
+
+    out.append((const char*)&record, sizeof(record));
+    out.append(sender, sender_length);
+    out.append(text, text_length);
+}
+
+// Records that failed their checksum on replay and were skipped
+std::atomic<uint64_t> archive_corrupt(0);
+
+// Walks the complete records of a mapped segment, or of a batch of encoded
+// records when start is 0. Returns the end offset of the last complete
+// record, so a torn tail can be cut off. A record failing its checksum is
+// skipped and counted, or treated as torn when it is the last one. An empty
+// record is valid when its checksum is; zeroed bytes end the data.
+template <typename Visit>
+size_t segment_records(const char* data, size_t size, Visit visit, size_t start = sizeof(SegmentHeader)) {
+    size_t pos = start;
+    while (pos + sizeof(ArchiveRecord) <= size) {
+        ArchiveRecord record;
+        memcpy(&record, data + pos, sizeof(record));
+        if (record.sender_length > record.size || pos + sizeof(record) + record.size > size) break;
+
+        const char* sender = data + pos + sizeof(record);
+        if (record.size == 0 && record_crc(record, sender) != record.crc) break;
+        size_t next = pos + sizeof(record) + record.size;
+        if (record_crc(record, sender) != record.crc) {
+            if (next == size) break;
+            archive_corrupt++;
+            pos = next;
+            continue;
+        }
+
+        if (!visit(record, sender, sender + record.sender_length)) break;
+        pos = next;
+    }
+    return pos;
+}
+
+// Walks every record of a segment file, plain or compressed. Blocks of a
+// compressed segment entirely outside [after, before) are not decompressed.
+// Returns false if the file cannot be read or visit stopped the walk.
+template <typename Visit>
+bool segment_read(const std::string& path, int64_t after, int64_t before, Visit visit) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = (size_t)info.st_size;
+
+    if (!segment_compressed(path)) {
+        void* data = size > sizeof(SegmentHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        bool stopped = false;
+        segment_records((const char*)data, size,
+            [&](const ArchiveRecord& record, const char* sender, const char* text) {
+                stopped = !visit(record, sender, text);
+                return !stopped;
+            });
+        munmap(data, size);
+        return !stopped;
+    }
+
+    CompressedHeader header;
+    bool ok = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+              header.magic == COMPRESSED_MAGIC && header.version == ARCHIVE_VERSION &&
+              sizeof(header) + (uint64_t)header.block_count * sizeof(BlockEntry) <= size;
+    std::vector<BlockEntry> blocks(ok ? header.block_count : 0);
+    if (ok && !blocks.empty()) {
+        size_t table_bytes = blocks.size() * sizeof(BlockEntry);
+        ok = pread(fd, &blocks[0], table_bytes, sizeof(header)) == (ssize_t)table_bytes;
+    }
+
+    std::vector<char> compressed, raw;
+    for (size_t b = 0; ok && b < blocks.size(); b++) {
+        const BlockEntry& block = blocks[b];
+        if (block.max_timestamp < after || block.min_timestamp >= before) continue;
+
+        compressed.resize(block.compressed_size);
+        raw.resize(block.raw_size);
+        uLongf raw_size = block.raw_size;
+        ok = block.offset + block.compressed_size <= size &&
+             pread(fd, compressed.data(), compressed.size(), (off_t)block.offset) == (ssize_t)compressed.size() &&
+             uncompress((Bytef*)raw.data(), &raw_size, (const Bytef*)compressed.data(), compressed.size()) == Z_OK;
+        if (!ok) break;
+
+        segment_records(raw.data(), raw_size,
+            [&](const ArchiveRecord& record, const char* sender, const char* text) {
+                ok = visit(record, sender, text);
+                return ok;
+            }, 0);
+    }
+
+    // Cold data: do not let it crowd hot segments out of the page cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return ok;
+}
+
+// Opens a new active segment whose first record will be first_seq
+bool archive_new_segment(Archive& archive, uint64_t first_seq) {
+    char name[64];
+    snprintf(name, sizeof(name), "/seg-%016llu.log", (unsigned long long)first_seq);
+    archive.segment_path = archive.dir + name;
+    archive.segment_fd = open(archive.segment_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (archive.segment_fd == -1) return false;
+
+    SegmentHeader header = { SEGMENT_MAGIC, ARCHIVE_VERSION, first_seq };
+    if (write(archive.segment_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) return false;
+    fdatasync(archive.segment_fd);
+
+    // Make the new directory entry itself durable
+    int dir_fd = open(archive.dir.c_str(), O_RDONLY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    archive.segment_size = sizeof(header);
+    summary_reset(archive.summary, first_seq);
+    return true;
+}
+
+// Reopen the unsummarized tail segment: rebuild its summary from the records
+// and drop a torn last record
+bool archive_resume_segment(Archive& archive, const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd == -1) return false;
+
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = (size_t)info.st_size;
+    SegmentHeader header;
+    if (size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != SEGMENT_MAGIC || header.version != ARCHIVE_VERSION) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    summary_reset(archive.summary, header.first_seq);
+    SegmentSummary& summary = archive.summary;
+    size_t end = segment_records((const char*)data, size,
+        [&summary](const ArchiveRecord& record, const char* sender, const char* text) {
+            summary_add(summary, record, sender, text);
+            return true;
+        });
+    munmap(data, size);
+
+    if (end < size && ftruncate(fd, (off_t)end) != 0) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    archive.segment_path = path;
+    archive.segment_fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    archive.segment_size = end;
+    archive.next_seq = summary.last_seq + 1;
+    return archive.segment_fd != -1;
+}
+
+void archive_close_segment(Archive& archive) {
+    if (archive.segment_fd == -1) return;
+    fdatasync(archive.segment_fd);
+    close(archive.segment_fd);
+    archive.segment_fd = -1;
+    if (archive.summary.count > 0) summary_write(archive.summary, summary_path(archive.segment_path));
+}
+
+// Write a file under a temporary name and rename it into place once durable
+bool write_file_atomic(const std::string& path, const std::string& data) {
+    std::string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return false;
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fdatasync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temp.c_str(), path.c_str()) == 0) return true;
+    unlink(temp.c_str());
+    return false;
+}
+
+// Encode records as a compressed segment: the records are cut into blocks of
+// about COMPRESS_BLOCK_BYTES on record boundaries and each block is deflated
+// on its own
+bool segment_write_compressed(const std::string& path, uint64_t first_seq, const std::string& records) {
+    std::vector<BlockEntry> blocks;
+    std::vector<size_t> starts;
+    segment_records(records.data(), records.size(),
+        [&](const ArchiveRecord& record, const char* sender, const char*) {
+            size_t offset = sender - sizeof(ArchiveRecord) - records.data();
+            if (blocks.empty() || blocks.back().raw_size + sizeof(record) + record.size > COMPRESS_BLOCK_BYTES) {
+                BlockEntry block = { 0, 0, 0, INT64_MAX, INT64_MIN };
+                blocks.push_back(block);
+                starts.push_back(offset);
+            }
+            BlockEntry& block = blocks.back();
+            block.raw_size += (uint32_t)(sizeof(record) + record.size);
+            if (record.timestamp < block.min_timestamp) block.min_timestamp = record.timestamp;
+            if (record.timestamp > block.max_timestamp) block.max_timestamp = record.timestamp;
+            return true;
+        }, 0);
+
+    CompressedHeader header = { COMPRESSED_MAGIC, ARCHIVE_VERSION, first_seq, (uint32_t)blocks.size(), 0 };
+    std::string body;
+    std::vector<Bytef> out;
+    uint64_t offset = sizeof(header) + blocks.size() * sizeof(BlockEntry);
+    for (size_t b = 0; b < blocks.size(); b++) {
+        uLongf size = compressBound(blocks[b].raw_size);
+        out.resize(size);
+        if (compress2(out.data(), &size, (const Bytef*)records.data() + starts[b], blocks[b].raw_size,
+                      Z_DEFAULT_COMPRESSION) != Z_OK) return false;
+
+        blocks[b].offset = offset;
+        blocks[b].compressed_size = (uint32_t)size;
+        body.append((const char*)out.data(), size);
+        offset += size;
+    }
+
+    std::string file((const char*)&header, sizeof(header));
+    if (!blocks.empty()) file.append((const char*)&blocks[0], blocks.size() * sizeof(BlockEntry));
+    file += body;
+    return write_file_atomic(path, file);
+}
+
+void archive_remove_segment(const std::string& path) {
+    unlink(path.c_str());
+    unlink(summary_path(path).c_str());
+}
+
+// Rewrite a closed segment without its messages older than cutoff, block
+// compressed when cold. The summary is replaced after the data, so a crash in
+// between leaves a summary that still covers everything in the segment.
+void archive_compact_segment(const std::string& path, int64_t cutoff, bool cold) {
+    std::string records;
+    SegmentSummary summary;
+    bool first = true;
+    bool ok = segment_read(path, cutoff, INT64_MAX,
+        [&](const ArchiveRecord& record, const char* sender, const char* text) {
+            if (record.timestamp < cutoff) return true;
+            if (first) summary_reset(summary, record.seq);
+            first = false;
+            records.append((const char*)&record, sizeof(record));
+            records.append(sender, record.size);
+            summary_add(summary, record, sender, text);
+            return true;
+        });
+    if (!ok) {
+        std::cerr << "Failed to read archive segment " << path << std::endl;
+        return;
+    }
+    if (first) {
+        archive_remove_segment(path);
+        return;
+    }
+
+    std::string target = segment_stem(path) + (cold ? ".z" : ".log");
+    if (cold) {
+        ok = segment_write_compressed(target, summary.first_seq, records);
+    } else {
+        SegmentHeader header = { SEGMENT_MAGIC, ARCHIVE_VERSION, summary.first_seq };
+        ok = write_file_atomic(target, std::string((const char*)&header, sizeof(header)) + records);
+    }
+    if (!ok) {
+        std::cerr << "Failed to compact archive segment " << path << std::endl;
+        return;
+    }
+
+    summary_write(summary, summary_path(target));
+    if (target != path) unlink(path.c_str());
+
+    // The plain segment was just read once more; keep it out of the page cache
+    int fd = open(target.c_str(), O_RDONLY);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Background maintenance of the closed segments, oldest first: delete the
+// ones entirely past the retention period or over the disk cap, compress the
+// cold ones and compact the ones holding expired messages. The newest segment
+// is the active one and is left alone.
+void archive_maintain(Archive* archive) {
+    std::vector<std::string> segments = archive_segments(archive->dir);
+    if (!segments.empty()) segments.pop_back();
+
+    std::vector<uint64_t> sizes(segments.size());
+    uint64_t total = SEGMENT_BYTES;
+    for (size_t i = 0; i < segments.size(); i++) {
+        struct stat info;
+        sizes[i] = stat(segments[i].c_str(), &info) == 0 ? (uint64_t)info.st_size : 0;
+        total += sizes[i];
+    }
+
+    int64_t cutoff = archive->retention_ms > 0 ? now_ms() - archive->retention_ms : INT64_MIN;
+    for (size_t i = 0; i < segments.size(); i++) {
+        {
+            std::lock_guard<std::mutex> guard(archive->lock);
+            if (archive->stopping) return;
+        }
+        SegmentSummary summary;
+        if (!summary_read(summary, summary_path(segments[i]))) continue;
+
+        bool over = archive->max_bytes > 0 && total > archive->max_bytes;
+        if (over || summary.max_timestamp < cutoff) {
+            archive_remove_segment(segments[i]);
+            total -= sizes[i];
+            continue;
+        }
+
+        bool cold = i + HOT_SEGMENTS < segments.size();
+        if ((cold && !segment_compressed(segments[i])) || summary.min_timestamp < cutoff) {
+            archive_compact_segment(segments[i], cutoff, cold);
+        }
+    }
+}
+
+// Maintenance has a thread of its own so compressing a segment never holds
+// up searches on the worker pool. Rotations while it runs make it go over
+// the segments once more.
+void archive_maintainer(Archive* archive) {
+    trace_thread_name("archive maintenance");
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(archive->lock);
+            while (!archive->maintenance_requested && !archive->stopping) archive->maintain_wake.wait(guard);
+            if (archive->stopping) return;
+            archive->maintenance_requested = false;
+        }
+        TRACE_SPAN("archive maintenance");
+        archive_maintain(archive);
+    }
+}
+
+void archive_schedule_maintenance(Archive& archive) {
+    {
+        std::lock_guard<std::mutex> guard(archive.lock);
+        archive.maintenance_requested = true;
+    }
+    archive.maintain_wake.notify_one();
+}
+
+// Write records to the active segment with a single write() and make them
+// durable with a single fdatasync()
+// Returns false if the records did not become durable. The segment is cut
+// back to the last good commit so its summary and size still describe it; if
+// even that fails it is left for the next writer to repair on resume.
+bool archive_commit(Archive& archive, const char* data, size_t size) {
+    if (archive.segment_fd == -1) return false;
+    TRACE_SPAN("archive commit");
+    if (write(archive.segment_fd, data, size) != (ssize_t)size || fdatasync(archive.segment_fd) != 0) {
+        std::cerr << "Failed to write archive segment" << std::endl;
+        if (ftruncate(archive.segment_fd, (off_t)archive.segment_size) != 0) {
+            close(archive.segment_fd);
+            archive.segment_fd = -1;
+        }
+        return false;
+    }
+    archive.segment_size += size;
+    archive.commits++;
+
+    SegmentSummary& summary = archive.summary;
+    segment_records(data, size,
+        [&summary](const ArchiveRecord& record, const char* sender, const char* text) {
+            summary_add(summary, record, sender, text);
+            return true;
+        }, 0);
+    return true;
+}
+
+// Group commit: appends only queue encoded records. The writer thread takes
+// everything queued so far as one batch, writes it with a single write() and
+// makes it durable with a single fdatasync(), while the next batch collects.
+// At most the batch being synced plus the one collecting can be lost.
+void archive_writer(Archive* archive) {
+    trace_thread_name("archive writer");
+    std::string batch;
+
+    for (;;) {
+        uint64_t last_seq;
+        {
+            std::unique_lock<std::mutex> guard(archive->lock);
+            while (archive->pending.empty() && !archive->stopping) archive->wake.wait(guard);
+            if (archive->pending.empty()) return;
+            batch.swap(archive->pending);
+            last_seq = archive->next_seq - 1;
+        }
+
+        // A batch is split at record boundaries wherever the segment reaches
+        // SEGMENT_BYTES, so a burst does not grow one segment past the limit
+        size_t done = 0;
+        bool durable = true;
+        while (done < batch.size()) {
+            if (archive->segment_size >= SEGMENT_BYTES) {
+                ArchiveRecord first;
+                memcpy(&first, batch.data() + done, sizeof(first));
+                archive_close_segment(*archive);
+                if (!archive_new_segment(*archive, first.seq)) {
+                    std::cerr << "Failed to open archive segment in " << archive->dir << std::endl;
+                }
+                archive_schedule_maintenance(*archive);
+            }
+
+            size_t end = done;
+            do {
+                ArchiveRecord record;
+                memcpy(&record, batch.data() + end, sizeof(record));
+                end += sizeof(record) + record.size;
+            } while (end < batch.size() && archive->segment_size + (end - done) < SEGMENT_BYTES);
+            durable = archive_commit(*archive, batch.data() + done, end - done) && durable;
+            done = end;
+        }
+
+        if (durable) archive->durable_seq = last_seq;
+        batch.clear();
+    }
+}
+
+// Become the archive writer if no other process is: lock the directory,
+// resume or start the tail segment and start the group commit thread
+bool archive_claim(Archive& archive) {
+    if (archive.lock_fd != -1) return true;
+    if (archive.dir.empty()) return false;
+
+    int lock_fd = open((archive.dir + "/writer.lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd == -1) return false;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd);
+        return false;
+    }
+    archive.lock_fd = lock_fd;
+    archive.next_seq = 1;
+
+    std::vector<std::string> segments = archive_segments(archive.dir);
+    bool resumed = false;
+    if (!segments.empty()) {
+        SegmentSummary last;
+        if (summary_read(last, summary_path(segments.back()))) {
+            archive.next_seq = last.last_seq + 1;
+        } else {
+            resumed = archive_resume_segment(archive, segments.back());
+        }
+    }
+
+    if (!resumed && !archive_new_segment(archive, archive.next_seq)) {
+        std::cerr << "Failed to open archive segment in " << archive.dir << std::endl;
+    }
+
+    archive.durable_seq = archive.next_seq - 1;
+    archive.stopping = false;
+    archive.maintenance_requested = true;
+    archive.writer = std::thread(archive_writer, &archive);
+    archive.maintainer = std::thread(archive_maintainer, &archive);
+    return true;
+}
+
+void archive_open(Archive& archive) {
+    const char* dir = getenv("CHAT_ARCHIVE_DIR");
+    archive.dir = dir != NULL ? dir : "chat_archive";
+    archive.lock_fd = -1;
+    archive.segment_fd = -1;
+
+    const char* days = getenv("CHAT_RETENTION_DAYS");
+    const char* mb = getenv("CHAT_ARCHIVE_MB");
+    archive.retention_ms = days != NULL ? (int64_t)atol(days) * 24 * 3600 * 1000 : 0;
+    archive.max_bytes = mb != NULL ? (uint64_t)atol(mb) * 1024 * 1024 : 0;
+    archive.maintenance_requested = false;
+
+    mkdir(archive.dir.c_str(), 0755);
+}
+
+// Flush what is queued and leave the active segment unsummarized; the next
+// writer resumes it
+void archive_shutdown(Archive& archive) {
+    if (archive.lock_fd == -1) return;
+
+    {
+        std::lock_guard<std::mutex> guard(archive.lock);
+        archive.stopping = true;
+    }
+    archive.wake.notify_one();
+    archive.maintain_wake.notify_one();
+    archive.writer.join();
+    archive.maintainer.join();
+
+    if (archive.segment_fd != -1) close(archive.segment_fd);
+    archive.segment_fd = -1;
+    close(archive.lock_fd);
+    archive.lock_fd = -1;
+}
+
+// Queue a record for the writer thread; a no-op unless this process writes
+// the archive. Returns the record's archive sequence number, 0 if not queued.
+uint64_t archive_append(Archive& archive, const char* sender, size_t sender_length,
+                        const char* text, size_t text_length, int64_t timestamp, uint64_t ring_seq) {
+    if (archive.lock_fd == -1) return 0;
+
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> guard(archive.lock);
+        seq = archive.next_seq++;
+        record_encode(archive.pending, seq, ring_seq, timestamp, sender, sender_length, text, text_length);
+    }
+    archive.wake.notify_one();
+    return seq;
+}
+
+int64_t parse_date_ms(const std::string& date) {
+    struct tm when;
+    memset(&when, 0, sizeof(when));
+    if (sscanf(date.c_str(), "%d-%d-%d", &when.tm_year, &when.tm_mon, &when.tm_mday) != 3) return -1;
+    when.tm_year -= 1900;
+    when.tm_mon -= 1;
+    when.tm_isdst = -1;
+    return (int64_t)mktime(&when) * 1000;
+}
+
+ArchiveQuery archive_parse_query(const std::string& text) {
+    ArchiveQuery query;
+    query.after = INT64_MIN;
+    query.before = INT64_MAX;
+
+    std::string rest;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(' ', start);
+        if (end == std::string::npos) end = text.size();
+        std::string term = text.substr(start, end - start);
+        start = end + 1;
+
+        if (term.compare(0, 5, "from:") == 0) query.sender = term.substr(5);
+        else if (term.compare(0, 6, "after:") == 0) query.after = parse_date_ms(term.substr(6));
+        else if (term.compare(0, 7, "before:") == 0) query.before = parse_date_ms(term.substr(7));
+        else rest += term + " ";
+    }
+
+    search_tokenize(rest.c_str(), rest.size(), query.words);
+    return query;
+}
+
+bool summary_may_match(const SegmentSummary& summary, const ArchiveQuery& query) {
+    if (summary.max_timestamp < query.after || summary.min_timestamp >= query.before) return false;
+    if (!query.sender.empty() &&
+        std::find(summary.senders.begin(), summary.senders.end(), query.sender) == summary.senders.end()) return false;
+    for (size_t i = 0; i < query.words.size(); i++) {
+        if (!bloom_test(summary.bloom, summary.bloom_hashes, query.words[i])) return false;
+    }
+    return true;
+}
+
+// Whether text contains word as a whole token, by the search_tokenize rules
+bool text_has_token(const char* text, size_t length, const std::string& word) {
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && !((unsigned char)text[i] >= 0x80 || isalnum((unsigned char)text[i]))) i++;
+        size_t start = i;
+        while (i < length && ((unsigned char)text[i] >= 0x80 || isalnum((unsigned char)text[i]))) i++;
+
+        if (i - start == word.size()) {
+            size_t k = 0;
+            while (k < word.size() && (char)tolower((unsigned char)text[start + k]) == word[k]) k++;
+            if (k == word.size()) return true;
+        }
+    }
+    return false;
+}
+
+void archive_search_segment(ArchiveSearch* search, const std::string& path) {
+    const ArchiveQuery& query = search->query;
+
+    SegmentSummary summary;
+    if (summary_read(summary, summary_path(path)) && !summary_may_match(summary, query)) {
+        search->skipped++;
+        return;
+    }
+
+    std::vector<ArchiveHit> hits;
+    size_t matched = 0;
+    segment_read(path, query.after, query.before,
+        [&](const ArchiveRecord& record, const char* sender, const char* text) {
+            if (search->cancel.load(std::memory_order_relaxed)) return false;
+            if (record.timestamp < query.after || record.timestamp >= query.before) return true;
+
+            size_t text_length = record.size - record.sender_length;
+            if (!query.sender.empty() &&
+                (query.sender.size() != record.sender_length ||
+                 memcmp(query.sender.data(), sender, record.sender_length) != 0)) return true;
+            for (size_t i = 0; i < query.words.size(); i++) {
+                if (!text_has_token(text, text_length, query.words[i])) return true;
+            }
+
+            matched++;
+            ArchiveHit hit;
+            hit.seq = record.seq;
+            hit.timestamp = record.timestamp;
+            hit.sender.assign(sender, record.sender_length);
+            hit.text.assign(text, text_length);
+            hits.push_back(hit);
+            if (hits.size() >= 2 * ARCHIVE_HITS_MAX) hits.erase(hits.begin(), hits.begin() + ARCHIVE_HITS_MAX);
+            return true;
+        });
+
+    // Only the newest hits of a segment can make the overall cut
+    if (hits.size() > ARCHIVE_HITS_MAX) hits.erase(hits.begin(), hits.end() - ARCHIVE_HITS_MAX);
+
+    search->matched += matched;
+    if (!hits.empty()) {
+        std::lock_guard<std::mutex> guard(search->lock);
+        search->found.insert(search->found.end(), hits.begin(), hits.end());
+    }
+}
+
+void archive_search_worker(ArchiveSearch* search) {
+    while (!search->cancel.load(std::memory_order_relaxed)) {
+        size_t next = search->next_segment.fetch_add(1);
+        if (next >= search->segments.size()) break;
+        archive_search_segment(search, search->segments[next]);
+    }
+    search->running.fetch_sub(1);
+}
+
+void archive_search_stop(ArchiveSearch& search) {
+    search.cancel = true;
+    search.running -= (int)pool_cancel(worker_pool, &search);
+    while (search.running > 0) std::this_thread::yield();
+    search.found.clear();
+}
+
+void archive_search_start(ArchiveSearch& search, const Archive& archive, const std::string& text) {
+    archive_search_stop(search);
+
+    search.query = archive_parse_query(text);
+    search.segments = archive_segments(archive.dir);
+    search.next_segment = 0;
+    search.matched = 0;
+    search.skipped = 0;
+    search.cancel = false;
+    if (search.query.words.empty() && search.query.sender.empty()) return;
+
+    ArchiveSearch* shared = &search;
+    search.running = (int)worker_pool.threads.size();
+    for (size_t i = 0; i < worker_pool.threads.size(); i++) {
+        pool_submit(worker_pool, [shared]() { archive_search_worker(shared); }, shared);
+    }
+}
+
+bool hit_newer(const ArchiveHit& a, const ArchiveHit& b) {
+    return a.seq > b.seq;
+}
+
+// Merge hits found since the last call, newest first, capped at ARCHIVE_HITS_MAX
+bool archive_search_drain(ArchiveSearch& search, std::vector<ArchiveHit>& hits) {
+    std::vector<ArchiveHit> fresh;
+    {
+        std::lock_guard<std::mutex> guard(search.lock);
+        fresh.swap(search.found);
+    }
+    if (fresh.empty()) return false;
+
+    hits.insert(hits.end(), fresh.begin(), fresh.end());
+    std::sort(hits.begin(), hits.end(), hit_newer);
+    if (hits.size() > ARCHIVE_HITS_MAX) hits.resize(ARCHIVE_HITS_MAX);
+    return true;
+}
+
+size_t latency_bucket(int64_t value) {
+    if (value < 0) value = 0;
+    if (value > LATENCY_MAX) value = LATENCY_MAX;
+    if (value < 64) return (size_t)value;
+    int shift = 63 - __builtin_clzll((uint64_t)value) - 5;
+    return 64 + (size_t)(shift - 1) * 32 + (size_t)((value >> shift) - 32);
+}
+
+// Middle of a bucket's value range
+int64_t latency_bucket_value(size_t bucket) {
+    if (bucket < 64) return (int64_t)bucket;
+    int shift = (int)((bucket - 64) / 32) + 1;
+    int64_t low = (int64_t)((bucket - 64) % 32 + 32) << shift;
+    return low + ((1LL << shift) >> 1);
+}
+
+void latency_reset(LatencyHistogram& histogram) {
+    memset(histogram.counts, 0, sizeof(histogram.counts));
+    histogram.total = 0;
+    histogram.max = 0;
+}
+
+void latency_record(LatencyHistogram& histogram, int64_t value) {
+    histogram.counts[latency_bucket(value)]++;
+    histogram.total++;
+    if (value > histogram.max) histogram.max = value;
+}
+
+// Value at or below which fraction of the recorded values fall
+int64_t latency_percentile(const LatencyHistogram& histogram, double fraction) {
+    if (histogram.total == 0) return 0;
+    uint64_t rank = (uint64_t)(fraction * histogram.total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram.counts[i];
+        if (seen >= rank) return std::min(latency_bucket_value(i), histogram.max);
+    }
+    return histogram.max;
+}
+
+// One summary line, then a "bucket value count" line per non-empty bucket so
+// dumps from several clients can be merged
+void latency_write(FILE* file, const char* name, const LatencyHistogram& histogram) {
+    fprintf(file, "%s count %llu p50 %lld p90 %lld p99 %lld p999 %lld max %lld\n", name,
+            (unsigned long long)histogram.total, (long long)latency_percentile(histogram, 0.5),
+            (long long)latency_percentile(histogram, 0.9), (long long)latency_percentile(histogram, 0.99),
+            (long long)latency_percentile(histogram, 0.999), (long long)histogram.max);
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram.counts[i] == 0) continue;
+        fprintf(file, "%s bucket %lld %llu\n", name, (long long)latency_bucket_value(i),
+                (unsigned long long)histogram.counts[i]);
+    }
+}
+
+// Global variables
+MessageHistory chat_messages;
+SearchIndex search_index;
+SubstringScan substring_scan;
+Archive chat_archive;
+ArchiveSearch archive_search;
+std::string my_username;
+uint32_t my_client_id;                  // Tags our slots so our own echo is not ingested twice
+
+RingCursor ring_cursor;
+
+// Shared memory functions (from your shared_memo)
+key_t get_key() {
+    // Project id 66: the ring layout is not compatible with older clients
+    key_t shm_key = ftok("shmfile", 66);
+    return shm_key;
+}
+
+// Returns -1 without reporting it; callers that retry log once per outage
+int share_memory(key_t shm_key) {
+    return shmget(shm_key, sizeof(ShmRing), 0666 | IPC_CREAT);
+}
+
+char* shm_access(int shm_id) {
+    char* shm_ptr = (char*)shmat(shm_id, NULL, 0);
+    return shm_ptr;
+}
+
+void shm_cleanup(char* shm_ptr) {
+    if (shmdt(shm_ptr) == -1) {
+        std::cerr << "Failed to detach shared memory" << std::endl;
+    }
+}
+
+uint32_t slot_crc(uint32_t writer, uint32_t client_seq, int64_t timestamp, int64_t sent_us,
+                  const char* data, size_t length) {
+    uint32_t crc = crc32c(0, &writer, sizeof(writer));
+    crc = crc32c(crc, &client_seq, sizeof(client_seq));
+    crc = crc32c(crc, &timestamp, sizeof(timestamp));
+    crc = crc32c(crc, &sent_us, sizeof(sent_us));
+    return crc32c(crc, data, length);
+}
+
+// Write payloads into consecutive slots without waking readers; see
+// ring_notify. The whole batch is reserved with one increment of head.
+// Returns the sequence number of the first. A fresh segment is zero filled,
+// which is an empty ring.
+uint64_t ring_write_batch(ShmRing* ring, uint32_t writer, const RingPayload* payloads, size_t count) {
+    int64_t timestamp = now_ms();
+    uint64_t first = ring->head.fetch_add(count, std::memory_order_acq_rel);
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t seq = first + i;
+        size_t length = std::min(payloads[i].length, (size_t)MESSAGE_MAX);
+        RingSlot& slot = ring->slots[seq % RING_SLOTS];
+
+        // Take the slot exclusively. A writer a whole lap ahead may already
+        // own it, in which case this message is dropped as readers would skip
+        // it anyway. A slot left busy by a writer that died is taken once it
+        // has been busy for RING_ABANDONED_MS, when readers skip it too.
+        int64_t busy_since = 0;
+        bool claimed = false;
+        for (;;) {
+            uint64_t current = slot.seq.load(std::memory_order_relaxed);
+            if (current == SLOT_BUSY) {
+                int64_t now = now_ms();
+                if (busy_since == 0) busy_since = now;
+                if (now - busy_since < RING_ABANDONED_MS) {
+                    std::this_thread::yield();
+                    continue;
+                }
+            }
+            if (current != SLOT_BUSY && current > seq + 1) break;
+            if (slot.seq.compare_exchange_weak(current, SLOT_BUSY, std::memory_order_relaxed)) {
+                claimed = true;
+                break;
+            }
+        }
+        if (!claimed) continue;
+
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.length = (uint32_t)length;
+        slot.writer = writer;
+        slot.client_seq = payloads[i].client_seq;
+        slot.timestamp = timestamp;
+        slot.sent_us = payloads[i].sent_us;
+        slot.crc = slot_crc(writer, payloads[i].client_seq, timestamp, payloads[i].sent_us, payloads[i].data, length);
+        memcpy(slot.data, payloads[i].data, length);
+        slot.seq.store(seq + 1, std::memory_order_release);
+    }
+    return first;
+}
+
+// Wake readers after one or more ring writes. Shared futex: readers in
+// other processes sleep on it.
+void ring_notify(ShmRing* ring) {
+    ring->wake.fetch_add(1, std::memory_order_release);
+    if (ring->sleepers.load(std::memory_order_acquire) > 0) {
+        syscall(SYS_futex, (int*)&ring->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+uint64_t ring_publish(ShmRing* ring, uint32_t writer, uint32_t client_seq, const char* data, size_t length) {
+    RingPayload payload = { client_seq, wall_us(), data, length };
+    uint64_t seq = ring_write_batch(ring, writer, &payload, 1);
+    ring_notify(ring);
+    return seq;
+}
+
+// Sleep until the message at cursor is committed or anything else is
+// published, or the timeout passes. A slot reserved by a writer that died
+// keeps the reader here between timeouts rather than spinning.
+void ring_wait(ShmRing* ring, uint64_t cursor, int timeout_ms) {
+    uint32_t wake = ring->wake.load(std::memory_order_acquire);
+    ring->sleepers.fetch_add(1, std::memory_order_acq_rel);
+    if (ring->head.load(std::memory_order_acquire) <= cursor ||
+        ring->slots[cursor % RING_SLOTS].seq.load(std::memory_order_acquire) != cursor + 1) {
+        struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        syscall(SYS_futex, (int*)&ring->wake, FUTEX_WAIT, (int)wake, &timeout, NULL, 0);
+    }
+    ring->sleepers.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+// Take a free entry of the reader table, reclaiming those of processes that
+// exited without detaching. Returns -1 when the table is full; such a reader
+// is not waited for.
+int ring_reader_attach(ShmRing* ring, uint64_t position) {
+    uint32_t self = (uint32_t)getpid();
+    for (int i = 0; i < RING_READERS; i++) {
+        RingReader& reader = ring->readers[i];
+        uint32_t owner = reader.pid.load(std::memory_order_relaxed);
+        if (owner != 0 && (kill((pid_t)owner, 0) == 0 || errno != ESRCH)) continue;
+        reader.position.store(position, std::memory_order_relaxed);
+        if (reader.pid.compare_exchange_strong(owner, self, std::memory_order_acq_rel)) return i;
+    }
+    return -1;
+}
+
+void ring_reader_detach(ShmRing* ring, int reader) {
+    if (reader >= 0) ring->readers[reader].pid.store(0, std::memory_order_release);
+}
+
+// Position of the slowest live reader, or head when there is none. An
+// entry left by a process that died is freed instead.
+uint64_t ring_slowest_reader(ShmRing* ring, uint64_t head) {
+    uint64_t slowest = head;
+    for (int i = 0; i < RING_READERS; i++) {
+        RingReader& reader = ring->readers[i];
+        uint32_t owner = reader.pid.load(std::memory_order_acquire);
+        if (owner == 0) continue;
+        uint64_t position = reader.position.load(std::memory_order_relaxed);
+        if (position >= slowest) continue;
+        if (kill((pid_t)owner, 0) == -1 && errno == ESRCH) {
+            reader.pid.compare_exchange_strong(owner, 0, std::memory_order_relaxed);
+            continue;
+        }
+        slowest = position;
+    }
+    return slowest;
+}
+
+// Copy the next committed message at or after the cursor and advance it.
+// Slots overwritten before they could be read, or failing their checksum,
+// are skipped and counted. Returns false when the next message is not
+// committed yet.
+bool ring_next(ShmRing* ring, RingCursor& reader, RingMessage& out) {
+    uint64_t& cursor = reader.next;
+    uint64_t& lost = reader.lost;
+    for (;;) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (cursor >= head) return false;
+        if (head - cursor > RING_SLOTS) {
+            lost += head - RING_SLOTS - cursor;
+            cursor = head - RING_SLOTS;
+        }
+
+        RingSlot& slot = ring->slots[cursor % RING_SLOTS];
+        uint64_t before = slot.seq.load(std::memory_order_acquire);
+        if (before != cursor + 1) {
+            // Reserved but not committed yet. A writer that died mid-publish
+            // is skipped after RING_ABANDONED_MS, or sooner once half a ring
+            // has been published after it.
+            bool pending = before == SLOT_BUSY || before < cursor + 1;
+            if (pending && head - cursor <= RING_SLOTS / 2) {
+                int64_t now = now_ms();
+                if (reader.stalled_ms == 0) reader.stalled_ms = now;
+                if (now - reader.stalled_ms < RING_ABANDONED_MS) return false;
+            }
+            reader.stalled_ms = 0;
+            lost++;
+            cursor++;
+            continue;
+        }
+        reader.stalled_ms = 0;
+
+        uint32_t length = slot.length < MESSAGE_MAX ? slot.length : MESSAGE_MAX;
+        uint32_t crc = slot.crc;
+        out.seq = cursor;
+        out.writer = slot.writer;
+        out.client_seq = slot.client_seq;
+        out.timestamp = slot.timestamp;
+        out.sent_us = slot.sent_us;
+        out.length = length;
+        memcpy(out.data, slot.data, length);
+
+        // Overwritten while copying
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != before) {
+            lost++;
+            cursor++;
+            continue;
+        }
+
+        cursor++;
+        if (slot_crc(out.writer, out.client_seq, out.timestamp, out.sent_us, out.data, out.length) != crc) {
+            reader.corrupt++;
+            continue;
+        }
+        return true;
+    }
+}
+
+// Outbox record header, followed by the message text
+struct OutboxRecord {
+    uint32_t length;
+    uint32_t crc;
+};
+
+SendQueue send_queue;
+
+std::string outbox_path(const std::string& username) {
+    return user_file_path("CHAT_OUTBOX", "chat_outbox_", username, ".log");
+}
+
+// Append messages to the outbox with one write and one sync
+void outbox_store(SendQueue* sender, const std::vector<OutboundMessage>& messages) {
+    TRACE_SPAN("outbox store");
+    std::string records;
+    for (size_t i = 0; i < messages.size(); i++) {
+        const std::string& text = messages[i].text;
+        OutboxRecord record = { (uint32_t)text.size(), crc32c(0, text.data(), text.size()) };
+        records.append((const char*)&record, sizeof(record));
+        records += text;
+        sender->stored.push_back(messages[i]);
+    }
+    if (sender->outbox_fd == -1 ||
+        write(sender->outbox_fd, records.data(), records.size()) != (ssize_t)records.size() ||
+        fdatasync(sender->outbox_fd) != 0) {
+        std::cerr << "Failed to write outbox" << std::endl;
+    }
+    sender->outbox_count = sender->stored.size();
+}
+
+// Wait until a reservation of count slots would not overwrite messages the
+// slowest attached reader has yet to read. Gives up after SEND_BACKOFF_MS, so
+// a client whose UI thread stalls loses messages rather than blocking
+// everyone's sends.
+void publish_make_room(ShmRing* ring, size_t count) {
+    int64_t give_up = now_ms() + SEND_BACKOFF_MS;
+    for (;;) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        if (head + count <= ring_slowest_reader(ring, head) + RING_SLOTS || now_ms() >= give_up) return;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+// Publish messages in reservations of up to SEND_BATCH_MAX slots, waking
+// readers after each and letting them catch up before the next, so a burst
+// larger than the ring does not overwrite itself
+void publish_batch(ShmRing* ring, const std::vector<OutboundMessage>& messages) {
+    TRACE_SPAN("publish");
+    std::vector<std::string> payloads(messages.size());
+    std::vector<RingPayload> batch(messages.size());
+    for (size_t i = 0; i < messages.size(); i++) {
+        payloads[i] = my_username + ": " + messages[i].text;
+        RingPayload payload = { messages[i].client_seq, messages[i].sent_us, payloads[i].data(), payloads[i].size() };
+        batch[i] = payload;
+    }
+    for (size_t i = 0; i < batch.size(); i += SEND_BATCH_MAX) {
+        size_t count = std::min(batch.size() - i, (size_t)SEND_BATCH_MAX);
+        publish_make_room(ring, count);
+        ring_write_batch(ring, my_client_id, &batch[i], count);
+        ring_notify(ring);
+    }
+}
+
+void sender_run(SendQueue* sender) {
+    trace_thread_name("sender");
+    std::vector<OutboundMessage> batch;
+    for (;;) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> guard(sender->lock);
+            while (sender->queue.empty() && !sender->stopping &&
+                   (sender->stored.empty() || sender->ring.load() == NULL)) {
+                sender->wake.wait(guard);
+            }
+            // Linger briefly so a burst (fast typing, a split paste, a bot)
+            // goes out as one batch with one reservation and one wakeup
+            std::chrono::steady_clock::time_point until =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(SEND_LINGER_US);
+            while (!sender->queue.empty() && sender->queue.size() < SEND_BATCH_MAX && !sender->stopping &&
+                   sender->wake.wait_until(guard, until) != std::cv_status::timeout) {
+            }
+            batch.assign(sender->queue.begin(), sender->queue.end());
+            sender->queue.clear();
+            stopping = sender->stopping;
+        }
+
+        ShmRing* ring = sender->ring.load();
+        if (ring == NULL) {
+            if (!batch.empty()) outbox_store(sender, batch);
+        } else {
+            // Outbox first: it holds the older messages
+            if (!sender->stored.empty()) {
+                batch.insert(batch.begin(), sender->stored.begin(), sender->stored.end());
+                sender->stored.clear();
+                sender->outbox_count = 0;
+                publish_batch(ring, batch);
+                if (sender->outbox_fd != -1 && ftruncate(sender->outbox_fd, 0) == 0) fdatasync(sender->outbox_fd);
+            } else {
+                publish_batch(ring, batch);
+            }
+        }
+        if (stopping && batch.empty()) return;
+    }
+}
+
+// Reopen the outbox left by an earlier run. Its messages are echoed as
+// pending again and go out first once there is a ring.
+void sender_start(SendQueue& sender, ShmRing* ring, const std::string& outbox) {
+    sender.ring = ring;
+    sender.stopping = false;
+    sender.next_client_seq = 1;
+    sender.outbox_fd = open(outbox.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (sender.outbox_fd == -1) std::cerr << "Failed to open outbox " << outbox << std::endl;
+
+    std::string data;
+    char buffer[65536];
+    ssize_t got;
+    while (sender.outbox_fd != -1 && (got = read(sender.outbox_fd, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, got);
+    }
+    size_t offset = 0;
+    while (offset + sizeof(OutboxRecord) <= data.size()) {
+        OutboxRecord record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        const char* text = data.data() + offset + sizeof(record);
+        // A torn or damaged tail ends the outbox
+        if (record.length > data.size() - offset - sizeof(record) ||
+            crc32c(0, text, record.length) != record.crc) break;
+
+        OutboundMessage message;
+        message.client_seq = sender.next_client_seq++;
+        message.sent_us = wall_us();        // Time spent in an earlier run is not counted
+        message.text.assign(text, record.length);
+        size_t index = history_push(chat_messages, my_username.c_str(), my_username.size(), text,
+                                    record.length, MSG_MINE | MSG_PENDING);
+        search_index_add(search_index, index, text, record.length);
+        sender.pending.push_back(std::make_pair(message.client_seq, index));
+        sender.stored.push_back(message);
+        offset += sizeof(record) + record.length;
+    }
+    if (offset < data.size() && sender.outbox_fd != -1) {
+        std::string kept;
+        for (size_t i = 0; i < sender.stored.size(); i++) {
+            OutboxRecord record = { (uint32_t)sender.stored[i].text.size(), 0 };
+            record.crc = crc32c(0, sender.stored[i].text.data(), record.length);
+            kept.append((const char*)&record, sizeof(record));
+            kept += sender.stored[i].text;
+        }
+        if (ftruncate(sender.outbox_fd, 0) != 0 ||
+            write(sender.outbox_fd, kept.data(), kept.size()) != (ssize_t)kept.size() ||
+            fdatasync(sender.outbox_fd) != 0) {
+            std::cerr << "Failed to rewrite outbox " << outbox << std::endl;
+        }
+    }
+    sender.outbox_count = sender.stored.size();
+    sender.thread = std::thread(sender_run, &sender);
+}
+
+// The transport came up: the sender flushes the outbox and goes live
+void sender_connect(SendQueue& sender, ShmRing* ring) {
+    {
+        std::lock_guard<std::mutex> guard(sender.lock);
+        sender.ring = ring;
+    }
+    sender.wake.notify_one();
+}
+
+// Publishes whatever is still queued, or stores it when offline, before
+// returning
+void sender_stop(SendQueue& sender) {
+    if (!sender.thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> guard(sender.lock);
+        sender.stopping = true;
+    }
+    sender.wake.notify_one();
+    sender.thread.join();
+    if (sender.outbox_fd != -1) close(sender.outbox_fd);
+}
+
+// Our send client_seq came back on the ring
+void confirm_sent(SendQueue& sender, uint32_t client_seq) {
+    // Only the echoed message is confirmed: an earlier send that never came
+    // back was lost in the ring and stays pending
+    std::deque<std::pair<uint32_t, size_t> >::iterator found = sender.pending.begin();
+    while (found != sender.pending.end() && found->first != client_seq) ++found;
+    if (found == sender.pending.end()) return;
+
+    size_t page;
+    uint32_t slot;
+    if (history_locate(chat_messages, found->second, &page, &slot)) {
+        chat_messages.pages[page].index->flags[slot] &= ~MSG_PENDING;
+    }
+    sender.pending.erase(found);
+}
+
+// Queue a message for the sender thread and echo it locally as pending
+void send_message(SendQueue& sender, const std::string& message) {
+    if (message.empty()) return;
+    TRACE_SPAN("send");
+
+    size_t index = history_push(chat_messages, my_username.c_str(), my_username.size(), message.c_str(),
+                                message.size(), MSG_MINE | MSG_PENDING);
+    search_index_add(search_index, index, message.c_str(), message.size());
+
+    OutboundMessage outbound;
+    outbound.client_seq = sender.next_client_seq++;
+    outbound.sent_us = wall_us();
+    outbound.text = message;
+    sender.pending.push_back(std::make_pair(outbound.client_seq, index));
+    {
+        std::lock_guard<std::mutex> guard(sender.lock);
+        sender.queue.push_back(outbound);
+    }
+    sender.wake.notify_one();
+}
+
+Receiver receiver;
+
+// Free item to fill, or NULL while the queue is full
+IngestItem* ingest_queue_reserve(IngestQueue& queue) {
+    size_t tail = queue.tail.load(std::memory_order_relaxed);
+    if (tail - queue.head.load(std::memory_order_acquire) == INGEST_QUEUE_SLOTS) return NULL;
+    return &queue.items[tail & (INGEST_QUEUE_SLOTS - 1)];
+}
+
+void ingest_queue_push(IngestQueue& queue) {
+    queue.tail.store(queue.tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Oldest item not yet taken, or NULL when the queue is empty
+IngestItem* ingest_queue_front(IngestQueue& queue) {
+    size_t head = queue.head.load(std::memory_order_relaxed);
+    if (head == queue.tail.load(std::memory_order_acquire)) return NULL;
+    return &queue.items[head & (INGEST_QUEUE_SLOTS - 1)];
+}
+
+void ingest_queue_pop(IngestQueue& queue) {
+    queue.head.store(queue.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Parse one ring message "sender: text" into a queue item. Returns false for
+// malformed messages, including an empty sender or text.
+bool receiver_parse(const RingMessage& msg, IngestItem& item) {
+    const char* colon = (const char*)memmem(msg.data, msg.length, ": ", 2);
+    if (colon == NULL || colon == msg.data || colon + 2 == msg.data + msg.length) return false;
+
+    item.seq = msg.seq;
+    item.timestamp = msg.timestamp;
+    item.sent_us = msg.sent_us;
+    item.sender_length = (uint32_t)(colon - msg.data);
+    item.text_length = msg.length - item.sender_length - 2;
+    item.flags = my_username.compare(0, std::string::npos, msg.data, item.sender_length) == 0 ? MSG_MINE : 0;
+    memcpy(item.data, msg.data, item.sender_length);
+    memcpy(item.data + item.sender_length, colon + 2, item.text_length);
+
+    // The logger records everything published, our own sends included
+    archive_append(chat_archive, item.data, item.sender_length, item.data + item.sender_length,
+                   item.text_length, msg.timestamp, msg.seq);
+
+    // Our own sends are in the history already, pending; the echo confirms them
+    if (msg.writer == my_client_id) {
+        item.flags = MSG_ECHO;
+        item.client_seq = msg.client_seq;
+    }
+    return true;
+}
+
+// Hand a catch-up batch to the UI thread item by item, waiting while the
+// queue is full. Returns false if the receiver was stopped meanwhile.
+bool receiver_feed_batch(Receiver* receiver, const std::string& batch) {
+    bool fed = true;
+    segment_records(batch.data(), batch.size(),
+        [&](const ArchiveRecord& record, const char* sender, const char* text) {
+            IngestItem* item;
+            while ((item = ingest_queue_reserve(receiver->queue)) == NULL) {
+                if (receiver->stopping.load(std::memory_order_relaxed)) {
+                    fed = false;
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            item->seq = record.ring_seq;
+            item->timestamp = record.timestamp;
+            item->client_seq = 0;
+            item->sent_us = 0;
+            item->sender_length = std::min((uint32_t)record.sender_length, (uint32_t)MESSAGE_MAX);
+            item->text_length = std::min(record.size - record.sender_length, (uint32_t)MESSAGE_MAX - item->sender_length);
+            bool is_mine = my_username.compare(0, std::string::npos, sender, record.sender_length) == 0;
+            item->flags = is_mine ? MSG_MINE : 0;
+            memcpy(item->data, sender, item->sender_length);
+            memcpy(item->data + item->sender_length, text, item->text_length);
+            ingest_queue_push(receiver->queue);
+            return true;
+        }, 0);
+    return fed;
+}
+
+// Owns ring_cursor while running. A pending catch-up is read first and fed
+// through the queue, so check_messages splices it in under the frame budget;
+// the reader table entry is taken and the sender let go once it is done.
+void receiver_run(Receiver* receiver) {
+    trace_thread_name("receiver");
+    RingMessage msg;
+    int64_t next_claim = 0;
+
+    if (receiver->catchup) {
+        std::string batch = catch_up(receiver->ring, chat_archive.dir, receiver->catchup_since,
+                                     receiver->catchup_limit, ring_cursor);
+        if (!receiver_feed_batch(receiver, batch)) return;
+    }
+    receiver->position.store(ring_cursor.next, std::memory_order_relaxed);
+    receiver->reader = ring_reader_attach(receiver->ring, ring_cursor.next);
+    sender_connect(send_queue, receiver->ring);
+
+    while (!receiver->stopping.load(std::memory_order_relaxed)) {
+        // Become the archive writer, or take over if its writer has exited
+        int64_t now = now_ms();
+        if (now >= next_claim) {
+            archive_claim(chat_archive);
+            next_claim = now + 2000;
+        }
+
+        IngestItem* item = ingest_queue_reserve(receiver->queue);
+        if (item == NULL) {
+            // UI thread is behind; the ring buffers meanwhile
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        if (!ring_next(receiver->ring, ring_cursor, msg)) {
+            TRACE_SPAN("ring wait");
+            ring_wait(receiver->ring, ring_cursor.next, 100);
+            continue;
+        }
+        receiver->position.store(ring_cursor.next, std::memory_order_relaxed);
+        if (receiver->reader >= 0) {
+            receiver->ring->readers[receiver->reader].position.store(ring_cursor.next, std::memory_order_relaxed);
+        }
+        TRACE_SPAN("receive");
+        if (receiver_parse(msg, *item)) ingest_queue_push(receiver->queue);
+    }
+}
+
+// With catchup, the thread first catches up from ring position since, at
+// most limit messages; see catch_up. Otherwise it reads from ring_cursor.
+void receiver_start(Receiver& receiver, ShmRing* ring, bool catchup, uint64_t since, size_t limit) {
+    receiver.ring = ring;
+    receiver.queue.items = new IngestItem[INGEST_QUEUE_SLOTS];
+    receiver.queue.head = 0;
+    receiver.queue.tail = 0;
+    receiver.stopping = false;
+    receiver.position = ring_cursor.next;
+    receiver.reader = -1;
+    receiver.catchup = catchup;
+    receiver.catchup_since = since;
+    receiver.catchup_limit = limit;
+    receiver.thread = std::thread(receiver_run, &receiver);
+}
+
+void receiver_stop(Receiver& receiver) {
+    if (!receiver.thread.joinable()) return;
+    receiver.stopping = true;
+    receiver.ring->wake.fetch_add(1);
+    syscall(SYS_futex, (int*)&receiver.ring->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    receiver.thread.join();
+    ring_reader_detach(receiver.ring, receiver.reader);
+}
+
+size_t ingest_backlog(const IngestQueue& queue) {
+    return queue.tail.load(std::memory_order_acquire) - queue.head.load(std::memory_order_relaxed);
+}
+
+// Splice the messages the receiver has finished into the history until the
+// deadline (now_us() time). A burst larger than that stays queued and is
+// spread over the next frames; the receiver and ring buffer it meanwhile.
+// Each added message goes to the subscribers. Returns how many were added.
+size_t check_messages(IngestQueue& queue, int64_t deadline, const std::vector<ChatSubscriber>& subscribers) {
+    TRACE_SPAN("check messages");
+    size_t added = 0;
+    size_t handled = 0;     // Echoes included, they cost time too
+    for (IngestItem* item = ingest_queue_front(queue); item != NULL; item = ingest_queue_front(queue)) {
+        if (handled++ % INGEST_CHECK_EVERY == INGEST_CHECK_EVERY - 1 && now_us() >= deadline) break;
+
+        if (item->flags & MSG_ECHO) {
+            confirm_sent(send_queue, item->client_seq);
+            ingest_queue_pop(queue);
+            continue;
+        }
+
+        const char* text = item->data + item->sender_length;
+        size_t index = history_append(chat_messages, item->data, item->sender_length, text, item->text_length,
+                                      item->flags, item->timestamp);
+        search_index_add(search_index, index, text, item->text_length);
+        if (!subscribers.empty()) {
+            ChatEvent event = { index, item->data, item->sender_length, text, item->text_length,
+                                item->timestamp, item->sent_us, item->flags };
+            for (size_t k = 0; k < subscribers.size(); k++) subscribers[k](event);
+        }
+        ingest_queue_pop(queue);
+        added++;
+    }
+    if (added > 0) history_trim(chat_messages);
+    return added;
+}
+
+uint64_t segment_first_seq(const std::string& path) {
+    size_t name = path.rfind("/seg-");
+    return name == std::string::npos ? 0 : strtoull(path.c_str() + name + 5, NULL, 10);
+}
+
+// The newest limit records with lo <= seq < hi, oldest first
+void log_fetch(const std::string& dir, uint64_t lo, uint64_t hi, size_t limit, std::vector<ArchiveHit>& out) {
+    std::vector<std::string> segments = archive_segments(dir);
+    std::vector<ArchiveHit> found;      // Newest first
+
+    for (size_t i = segments.size(); i-- > 0 && found.size() < limit;) {
+        uint64_t first = segment_first_seq(segments[i]);
+        if (first >= hi) continue;
+
+        std::vector<ArchiveHit> records;
+        segment_read(segments[i], INT64_MIN, INT64_MAX,
+            [&](const ArchiveRecord& record, const char* sender, const char* text) {
+                if (record.seq < lo || record.seq >= hi) return true;
+                ArchiveHit hit;
+                hit.seq = record.seq;
+                hit.timestamp = record.timestamp;
+                hit.sender.assign(sender, record.sender_length);
+                hit.text.assign(text, record.size - record.sender_length);
+                records.push_back(hit);
+                return true;
+            });
+        for (size_t k = records.size(); k-- > 0 && found.size() < limit;) found.push_back(records[k]);
+        if (first <= lo) break;
+    }
+
+    out.assign(found.rbegin(), found.rend());
+}
+
+// Sequence number just past the newest logged message older than timestamp,
+// found through the segment summaries, 0 if there is none
+uint64_t log_seq_before(const std::string& dir, int64_t timestamp) {
+    std::vector<std::string> segments = archive_segments(dir);
+    for (size_t i = segments.size(); i-- > 0;) {
+        SegmentSummary summary;
+        if (summary_read(summary, summary_path(segments[i])) && summary.min_timestamp >= timestamp) continue;
+
+        uint64_t found = 0;
+        segment_read(segments[i], INT64_MIN, timestamp,
+            [&](const ArchiveRecord& record, const char*, const char*) {
+                if (record.timestamp < timestamp && record.seq + 1 > found) found = record.seq + 1;
+                return true;
+            });
+        if (found != 0) return found;
+    }
+    return 0;
+}
+
+// Late joiner catch-up: a starting client collects what it missed into one
+// batch, framed like archive records, and ingests it in a single pass before
+// the first frame instead of trickling it through the per-frame poll. The
+// newest part comes straight from the ring, anything older from the archive
+// log, whose records carry their ring position. The ring starts over at 0
+// when the shared memory segment is recreated, so the log is only followed
+// back to where ring positions stop decreasing.
+
+// Log records with ring position in [since, until), the newest limit of them
+void catch_up_from_log(const std::string& dir, uint64_t since, uint64_t until, size_t limit, std::string& batch) {
+    std::vector<std::string> segments = archive_segments(dir);
+    std::vector<std::string> found;         // Newest first
+    uint64_t newer = UINT64_MAX;            // Ring position of the record after the current one
+    bool done = limit == 0;
+
+    for (size_t i = segments.size(); i-- > 0 && !done;) {
+        std::string records;
+        std::vector<size_t> starts;
+        segment_read(segments[i], INT64_MIN, INT64_MAX,
+            [&](const ArchiveRecord& record, const char* sender, const char*) {
+                starts.push_back(records.size());
+                records.append(sender - sizeof(record), sizeof(record) + record.size);
+                return true;
+            });
+
+        for (size_t k = starts.size(); k-- > 0 && !done;) {
+            ArchiveRecord record;
+            memcpy(&record, records.data() + starts[k], sizeof(record));
+            if (record.ring_seq >= newer || record.ring_seq < since) {
+                done = true;
+                break;
+            }
+            newer = record.ring_seq;
+            if (record.ring_seq >= until) continue;
+
+            found.push_back(records.substr(starts[k], sizeof(record) + record.size));
+            done = found.size() >= limit;
+        }
+    }
+
+    for (size_t k = found.size(); k-- > 0;) batch += found[k];
+}
+
+// Everything from ring position since on, or the last limit messages when
+// since is unknown (UINT64_MAX), capped at limit. Leaves the cursor at the
+// ring head so the per-frame poll continues from there.
+std::string catch_up(ShmRing* ring, const std::string& dir, uint64_t since, size_t limit, RingCursor& cursor) {
+    TRACE_SPAN("catch up");
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (since > head) since = 0;     // Unknown, or from before the ring was recreated
+    uint64_t oldest = head > RING_SLOTS ? head - RING_SLOTS : 0;
+    cursor.next = std::max(since, oldest);
+
+    std::string recent;
+    std::vector<size_t> starts;
+    uint64_t until = UINT64_MAX;
+    RingMessage msg;
+    while (ring_next(ring, cursor, msg)) {
+        if (until == UINT64_MAX) until = msg.seq;
+        const char* colon = (const char*)memmem(msg.data, msg.length, ": ", 2);
+        if (colon == NULL) continue;
+
+        size_t sender_length = colon - msg.data;
+        starts.push_back(recent.size());
+        record_encode(recent, 0, msg.seq, msg.timestamp, msg.data, sender_length,
+                      colon + 2, msg.length - sender_length - 2);
+    }
+    if (until == UINT64_MAX) until = cursor.next;
+
+    std::string batch;
+    if (starts.size() >= limit) {
+        batch = recent.substr(starts[starts.size() - limit]);
+    } else {
+        catch_up_from_log(dir, since, until, limit - starts.size(), batch);
+        batch += recent;
+    }
+    return batch;
+}
+
+// Ingest a catch-up batch in one pass: every message is appended and
+// indexed, then the memory budget is applied once
+void ingest_batch(const std::string& batch) {
+    segment_records(batch.data(), batch.size(),
+        [](const ArchiveRecord& record, const char* sender, const char* text) {
+            size_t text_length = record.size - record.sender_length;
+            bool is_mine = my_username.compare(0, std::string::npos, sender, record.sender_length) == 0;
+            size_t index = history_append(chat_messages, sender, record.sender_length, text, text_length,
+                                          is_mine ? MSG_MINE : 0, record.timestamp);
+            search_index_add(search_index, index, text, text_length);
+            return true;
+        }, 0);
+    history_trim(chat_messages);
+}
+
+// Attach the shared segment, catch up from it and start receiving; the
+// receiver lets the sender flush its outbox once caught up. At startup the
+// catch-up is ingested here in one pass before the first frame. On a later
+// retry the receiver does it and feeds it through the ingest queue, so the
+// UI thread keeps to its frame budget. Returns NULL while the segment is
+// unavailable, reporting that once per outage.
+ShmRing* transport_connect(ChatClient& client, bool startup) {
+    client.shm_id = share_memory(get_key());
+    client.shm_ptr = client.shm_id != -1 ? shm_access(client.shm_id) : (char*)-1;
+    if (client.shm_ptr == (char*)-1) {
+        if (!client.offline_reported) {
+            std::cerr << "Failed to access shared memory, retrying every " << CONNECT_RETRY_MS / 1000
+                      << " s" << std::endl;
+        }
+        client.offline_reported = true;
+        client.shm_ptr = NULL;
+        return NULL;
+    }
+    client.offline_reported = false;
+
+    ShmRing* ring = (ShmRing*)client.shm_ptr;
+    if (startup) {
+        ingest_batch(catch_up(ring, chat_archive.dir, client.ring_resume, client.catchup_limit, ring_cursor));
+        receiver_start(receiver, ring, false, 0, 0);
+    } else {
+        receiver_start(receiver, ring, true, client.ring_resume, client.catchup_limit);
+    }
+    return ring;
+}
+
+// restore loads the history snapshot and saves it again on close. Returns
+// false when the client starts offline.
+bool chat_connect(ChatClient& client, const std::string& username, bool restore) {
+    my_username = username;
+    my_client_id = (uint32_t)getpid();
+    const char* trace = getenv("CHAT_TRACE");
+    if (trace != NULL && strcmp(trace, "0") != 0) trace_enabled = true;
+    trace_thread_name("ui");
+
+    history_init(chat_messages);
+    client.snapshot = restore ? snapshot_path(username) : "";
+    client.ring_resume = UINT64_MAX;
+    client.catchup_limit = CATCHUP_MAX;
+    if (restore && history_load_snapshot(chat_messages, client.snapshot, &client.ring_resume)) {
+        search_index.backfill_end = chat_messages.count;
+    } else {
+        const char* catchup = getenv("CHAT_CATCHUP");
+        client.catchup_limit = catchup != NULL ? (size_t)atol(catchup) : CATCHUP_MESSAGES;
+    }
+    archive_open(chat_archive);
+    pool_start(worker_pool);
+
+    // Without the segment sends go to the outbox until a retry succeeds
+    ring_cursor.next = client.ring_resume;
+    sender_start(send_queue, NULL, outbox_path(username));
+    client.shm_ptr = NULL;
+    client.offline_reported = false;
+    client.ring = transport_connect(client, true);
+    client.next_connect = now_ms() + CONNECT_RETRY_MS;
+    return client.ring != NULL;
+}
+
+void chat_subscribe(ChatClient& client, const ChatSubscriber& subscriber) {
+    client.subscribers.push_back(subscriber);
+}
+
+void chat_send(ChatClient& client, const std::string& text) {
+    (void)client;   // The send queue is shared by the process
+    send_message(send_queue, text);
+}
+
+// Returns the number of messages added to the history. Each poll starts a
+// new frame: only pages used since the last poll are kept from spilling, and
+// pages our own sends filled are released here if over budget.
+size_t chat_poll(ChatClient& client, int64_t deadline) {
+    chat_messages.frame++;
+    history_trim(chat_messages);
+    if (client.ring == NULL && now_ms() >= client.next_connect) {
+        client.ring = transport_connect(client, false);
+        client.next_connect = now_ms() + CONNECT_RETRY_MS;
+    }
+    size_t added = check_messages(receiver.queue, deadline, client.subscribers);
+    search_index_backfill(search_index, chat_messages, deadline);
+    return added;
+}
+
+// Stops the background threads, flushing the outbox or the ring, the archive
+// log and the snapshot
+void chat_close(ChatClient& client) {
+    sender_stop(send_queue);
+    receiver_stop(receiver);
+    check_messages(receiver.queue, INT64_MAX, client.subscribers);
+    scan_stop(substring_scan, chat_messages);
+    archive_search_stop(archive_search);
+    pool_stop(worker_pool);
+    archive_shutdown(chat_archive);
+    if (!client.snapshot.empty()) history_save_snapshot(chat_messages, client.snapshot, ring_cursor.next);
+    if (client.shm_ptr != NULL) shm_cleanup(client.shm_ptr);
+    history_free(chat_messages);
+}
+
+int chat_history_height(const ChatClient&) {
+    return chat_messages.height;
+}
+
+size_t chat_history_count(const ChatClient&) {
+    return chat_messages.count;
+}
+
+int64_t chat_oldest_timestamp(const ChatClient&) {
+    return chat_messages.count > 0 ? chat_messages.pages[0].index->timestamps[0] : INT64_MAX;
+}
+
+int chat_message_y(const ChatClient&, size_t index) {
+    size_t page;
+    uint32_t slot;
+    if (!history_locate(chat_messages, index, &page, &slot)) return chat_messages.height;
+    return chat_messages.pages[page].y + chat_messages.pages[page].index->y_offsets[slot];
+}
+
+void chat_visible(ChatClient&, int view_top, int view_bottom, std::vector<VisibleMessage>& out) {
+    history_visible(chat_messages, view_top, view_bottom, out);
+}
+
+void chat_mark_read(ChatClient&, int view_bottom) {
+    if (view_bottom > chat_messages.read_y) chat_messages.read_y = view_bottom;
+}
+
+size_t chat_unread(const ChatClient&) {
+    return history_count_below(chat_messages, chat_messages.read_y);
+}
+
+bool chat_online(const ChatClient& client) {
+    return client.ring != NULL;
+}
+
+size_t chat_backlog(const ChatClient&) {
+    return ingest_backlog(receiver.queue);
+}
+
+size_t chat_outbox_count(const ChatClient&) {
+    return send_queue.outbox_count.load();
+}
+
+// Messages published that the receiver has not read yet
+uint64_t chat_ring_lag(const ChatClient& client) {
+    if (client.ring == NULL) return 0;
+    return client.ring->head.load() - receiver.position.load();
+}
+
+void chat_search_stop(ChatClient&) {
+    scan_stop(substring_scan, chat_messages);
+    archive_search_stop(archive_search);
+}
+
+void chat_index_query(ChatClient&, const std::string& text, std::vector<uint32_t>& matches) {
+    search_query(search_index, chat_messages, text, matches);
+}
+
+void chat_scan_start(ChatClient&, const std::string& text) {
+    scan_start(substring_scan, chat_messages, text);
+}
+
+void chat_scan_drain(ChatClient&, std::vector<uint32_t>& matches) {
+    scan_drain(substring_scan, chat_messages, matches);
+}
+
+void chat_archive_search_start(ChatClient&, const std::string& text) {
+    archive_search_start(archive_search, chat_archive, text);
+}
+
+bool chat_archive_search_drain(ChatClient&, std::vector<ArchiveHit>& hits) {
+    return archive_search_drain(archive_search, hits);
+}
+
+ChatSearchStatus chat_search_status(const ChatClient&) {
+    ChatSearchStatus status;
+    status.indexed = search_index.indexed;
+    status.backfilling = search_index.backfill_next < search_index.backfill_end;
+    status.scanning = substring_scan.running > 0;
+    status.archive_running = archive_search.running > 0;
+    status.archive_matched = archive_search.matched;
+    return status;
+}
+
+void chat_fetch_log(ChatClient&, uint64_t lo, uint64_t hi, int64_t before_timestamp, size_t limit,
+                    const ChatLogHandler& done) {
+    std::string dir = chat_archive.dir;
+    pool_submit(worker_pool, [dir, lo, hi, before_timestamp, limit, done]() {
+        uint64_t end = hi != UINT64_MAX ? hi : log_seq_before(dir, before_timestamp);
+        std::vector<ArchiveHit> messages;
+        if (end > lo) log_fetch(dir, lo, end, limit, messages);
+        done(end, messages);
+    });
+}
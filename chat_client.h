@@ -0,0 +1,170 @@
+// Headless chat client: message history, search, the archive log and the
+// shared memory transport, with no window or raylib dependency. chat_gui.cpp
+// is one consumer; bots, load generators and benchmarks link the same code.
+// State is process global, so a process runs one client. The internals are
+// in chat_client_internal.h.
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <cstdio>
+#include <stdint.h>
+
+#define INGEST_BUDGET_US 2000    // Per frame time for ingest and search backfill
+#define MINE_HEIGHT 35           // Bubble plus gap, own messages
+#define THEIRS_HEIGHT 45         // Bubble plus gap, with the sender label
+
+#define MSG_MINE 0x1
+#define MSG_PENDING 0x2          // Own message not yet seen back on the ring
+
+int message_height(uint32_t flags);
+int64_t now_ms();
+int64_t now_us();
+int64_t wall_us();
+std::string user_file_path(const char* variable, const char* prefix, const std::string& username, const char* extension);
+
+// Tracing: scoped spans recorded into a ring of events owned by the thread
+// that records them, so a span costs two clock reads and a store and no
+// lock. Nothing is recorded unless trace_enabled is set (CHAT_TRACE=1 at
+// start). trace_dump writes what the buffers hold as Chrome trace JSON, for
+// chrome://tracing or Perfetto.
+extern std::atomic<bool> trace_enabled;
+
+struct TraceSpan {
+    const char* name;
+    int64_t start_us;
+    explicit TraceSpan(const char* span_name);
+    ~TraceSpan();
+};
+
+#define TRACE_JOIN(a, b) a##b
+#define TRACE_NAME(line) TRACE_JOIN(trace_span_, line)
+#define TRACE_SPAN(name) TraceSpan TRACE_NAME(__LINE__)(name)
+
+void trace_record(const char* name, int64_t start_us);
+void trace_thread_name(const char* name);
+bool trace_dump(const std::string& path);
+
+// A message inside the view, in list order. The strings stay valid for the
+// frame, as their page is pinned.
+struct VisibleMessage {
+    size_t index;           // History index
+    int y;                  // List position
+    const char* sender;
+    const char* text;
+    uint32_t flags;
+};
+
+// A message read back from the archive log
+struct ArchiveHit {
+    uint64_t seq;
+    int64_t timestamp;
+    std::string sender;
+    std::string text;
+};
+
+// Latency histograms, HDR style: values below 64 get a bucket each, and
+// above that every power of two is split into 32 linear buckets, so any
+// value is kept to about 3% at a fixed size from microseconds to weeks.
+// Recording is a few shifts and an increment.
+#define LATENCY_BUCKETS (64 + 35 * 32)
+#define LATENCY_MAX ((1LL << 41) - 1)
+
+struct LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    int64_t max;
+};
+
+void latency_reset(LatencyHistogram& histogram);
+void latency_record(LatencyHistogram& histogram, int64_t value);
+int64_t latency_percentile(const LatencyHistogram& histogram, double fraction);
+void latency_write(FILE* file, const char* name, const LatencyHistogram& histogram);
+
+// A message spliced into the history, as handed to subscribers. The pointers
+// are only valid during the call.
+struct ChatEvent {
+    size_t index;               // History index
+    const char* sender;
+    size_t sender_length;
+    const char* text;
+    size_t text_length;
+    int64_t timestamp;
+    int64_t sent_us;            // Sender's send time, wall clock microseconds
+    uint32_t flags;
+};
+
+typedef std::function<void(const ChatEvent&)> ChatSubscriber;
+
+extern std::string my_username;
+
+struct ShmRing;
+
+// Client API: connect restores the history, opens the archive and attaches
+// the transport, or starts offline and keeps retrying from poll. poll splices
+// received messages into the history until the deadline (now_us() time) and
+// hands each to the subscribers, on the calling thread, then indexes restored
+// history with what is left. Sends never block.
+struct ChatClient {
+    std::string snapshot;       // Empty when the history is not kept across runs
+    uint64_t ring_resume;       // Ring position the restored history is complete up to
+    size_t catchup_limit;
+    int shm_id;
+    char* shm_ptr;              // NULL while offline
+    ShmRing* ring;
+    int64_t next_connect;
+    bool offline_reported;      // The current outage was logged
+    std::vector<ChatSubscriber> subscribers;
+};
+
+bool chat_connect(ChatClient& client, const std::string& username, bool restore);
+void chat_subscribe(ChatClient& client, const ChatSubscriber& subscriber);
+void chat_send(ChatClient& client, const std::string& text);
+size_t chat_poll(ChatClient& client, int64_t deadline);
+void chat_close(ChatClient& client);
+
+// Views for a UI, on the thread that polls. Positions are list coordinates:
+// pixels from the top of the oldest message in the history.
+int chat_history_height(const ChatClient& client);
+size_t chat_history_count(const ChatClient& client);
+int64_t chat_oldest_timestamp(const ChatClient& client);    // INT64_MAX while empty
+int chat_message_y(const ChatClient& client, size_t index);
+void chat_visible(ChatClient& client, int view_top, int view_bottom, std::vector<VisibleMessage>& out);
+void chat_mark_read(ChatClient& client, int view_bottom);
+size_t chat_unread(const ChatClient& client);               // From others, below what was shown
+bool chat_online(const ChatClient& client);
+size_t chat_backlog(const ChatClient& client);              // Received, not yet in the history
+size_t chat_outbox_count(const ChatClient& client);         // Sends waiting for the ring
+uint64_t chat_ring_lag(const ChatClient& client);
+
+// Search: index queries answer at once, substring scans and archive searches
+// run on the worker pool and are drained once a frame. Matches are history
+// indexes in ascending order.
+struct ChatSearchStatus {
+    size_t indexed;             // Messages in the word index, grows while restored ones are backfilled
+    bool backfilling;
+    bool scanning;
+    bool archive_running;
+    size_t archive_matched;
+};
+
+void chat_search_stop(ChatClient& client);
+void chat_index_query(ChatClient& client, const std::string& text, std::vector<uint32_t>& matches);
+void chat_scan_start(ChatClient& client, const std::string& text);
+void chat_scan_drain(ChatClient& client, std::vector<uint32_t>& matches);
+void chat_archive_search_start(ChatClient& client, const std::string& text);
+bool chat_archive_search_drain(ChatClient& client, std::vector<ArchiveHit>& hits);
+ChatSearchStatus chat_search_status(const ChatClient& client);
+
+// Scroll-up pagination, on the worker pool: the newest limit logged messages
+// with lo <= seq < hi, oldest first. With hi UINT64_MAX the range ends at the
+// newest message logged before before_timestamp. done is called on the
+// worker with the end of the range and the messages.
+typedef std::function<void(uint64_t end, std::vector<ArchiveHit>& messages)> ChatLogHandler;
+void chat_fetch_log(ChatClient& client, uint64_t lo, uint64_t hi, int64_t before_timestamp, size_t limit,
+                    const ChatLogHandler& done);
+
+#endif
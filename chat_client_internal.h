@@ -0,0 +1,475 @@
+// Internals of the chat client library, for its own code and for the tools
+// that exercise its parts directly (load generator, benchmarks, self-check).
+// Applications use chat_client.h.
+#ifndef CHAT_CLIENT_INTERNAL_H
+#define CHAT_CLIENT_INTERNAL_H
+
+#include "chat_client.h"
+
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/ipc.h>
+
+#define MESSAGE_MAX 1024         // "sender: text" payload of one ring slot
+#define RING_SLOTS 256
+#define RING_READERS 64          // Readers whose progress writers can see
+#define RING_ABANDONED_MS 500    // A reserved slot still uncommitted this long is skipped
+#define INGEST_QUEUE_SLOTS 4096  // Receiver to UI thread queue, a power of two
+
+#define PAGE_TEXT_BYTES 65536  // Arena block size, also the spill unit
+#define PAGE_MESSAGES 1024
+#define PAGE_INDEX_INITIAL 32    // Index entries of a new page, doubled as it fills
+
+#define SNAPSHOT_MAGIC 0x504e5343      // "CSNP"
+#define SNAPSHOT_VERSION 1
+#define INGEST_CHECK_EVERY 32    // Messages between clock reads
+#define SEND_LINGER_US 1000      // Sender waits this long for more messages to batch
+#define SEND_BATCH_MAX 128       // Slots reserved at once, at most half the ring
+#define SEND_BACKOFF_MS 200      // Longest a publish waits for readers to make room
+
+#define SEGMENT_MAGIC 0x47455343       // "CSEG"
+#define SUMMARY_MAGIC 0x4d555343       // "CSUM"
+#define ARCHIVE_VERSION 1
+#define COMPRESSED_MAGIC 0x5a455343     // "CSEZ"
+#define SEGMENT_BYTES (4 * 1024 * 1024)
+#define HOT_SEGMENTS 4                 // Newest closed segments kept uncompressed
+#define COMPRESS_BLOCK_BYTES 65536     // Records per compressed block, before compression
+#define BLOOM_BITS_PER_TOKEN 10        // About 1% false positives at BLOOM_HASHES
+#define BLOOM_HASHES 7
+#define ARCHIVE_HITS_MAX 500
+
+#define DEFAULT_HISTORY_MB 64
+#define CATCHUP_MESSAGES 200     // Backfilled on a first start, CHAT_CATCHUP overrides
+#define CATCHUP_MAX 20000        // Cap when resuming from a snapshot
+#define CONNECT_RETRY_MS 5000    // Offline clients retry the shared segment this often
+
+#define MSG_ECHO 0x4             // Ingest item only: our own send coming back
+
+#define TRACE_EVENTS 65536       // Spans kept per thread, the oldest are overwritten
+
+// History index of one page as parallel arrays, one entry per message, so
+// culling, unread counting and sender filters scan a single contiguous field.
+// Message text lives NUL terminated in the page's arena block and sender
+// names in the interned sender table. The columns share one allocation that
+// grows with the tail page and is cut to the message count when the page
+// closes, so a page of a few long messages carries no empty entries.
+struct PageIndex {
+    int64_t* timestamps;                    // Milliseconds since the epoch
+    uint32_t* sender_ids;
+    uint32_t* flags;
+    int32_t* y_offsets;                     // Relative to the page top
+    uint32_t* text_offsets;
+    uint32_t* text_lengths;
+    uint16_t* heights;
+    uint32_t capacity;
+    char* columns;                          // The allocation, NULL for snapshot memory
+};
+
+// Chat history is kept in pages: one arena block of message text plus its
+// index. A page closes when either is full. When resident blocks go over the
+// memory budget, the least recently used full blocks are appended to a spill
+// file and released; scrolling back to them reads them in again. The index,
+// about 30 bytes a message, always stays resident and counts toward the
+// budget, so a budget smaller than the index of the whole history only keeps
+// the tail page's text in memory. Pages restored from a snapshot point straight into
+// its mapping and are paged in by the kernel as they are first touched.
+struct HistoryPage {
+    PageIndex* index;
+    uint32_t count;
+    char* text;             // PAGE_TEXT_BYTES arena block, NULL while spilled
+    uint32_t text_used;
+    size_t first;           // History index of the page's first message
+    int y;                  // Top of the page in list coordinates
+    int height;
+    long spill_offset;      // -1 until written to the spill file
+    unsigned int last_used;
+    bool mapped;            // Index and text are read-only snapshot memory
+};
+
+struct MessageHistory {
+    std::vector<HistoryPage> pages;
+    std::vector<std::string> senders;                   // sender id -> name
+    std::unordered_map<std::string, uint32_t> sender_ids;
+    std::vector<char*> free_blocks;
+    std::vector<char*> retired_columns;     // Replaced index columns a scan may still read
+    size_t count;
+    int height;
+    int read_y;             // Lowest list position shown so far, for unread counts
+    size_t budget;
+    size_t resident_bytes;
+    FILE* spill;            // Anonymous append-only file, opened on first spill
+    void* mapping;          // Snapshot the mapped pages point into, or NULL
+    size_t mapping_size;
+    unsigned int frame;     // Pages used during the current frame are pinned
+    bool hold_blocks;       // Background scans read resident blocks, do not release
+};
+
+// Per thread trace buffers, see TRACE_SPAN
+struct TraceEvent {
+    const char* name;           // A string literal
+    int64_t start_us;           // now_us() time
+    int64_t duration_us;
+};
+
+struct TraceBuffer {
+    uint32_t tid;
+    const char* thread_name;
+    TraceEvent events[TRACE_EVENTS];
+    std::atomic<uint64_t> count;        // Events recorded, written by the owning thread only
+};
+
+void history_init(MessageHistory& history);
+void history_free(MessageHistory& history);
+const char* history_sender(const MessageHistory& history, const HistoryPage& page, uint32_t k);
+const char* history_text(const HistoryPage& page, uint32_t k);
+void history_trim(MessageHistory& history);
+HistoryPage& history_load_page(MessageHistory& history, size_t index);
+size_t history_append(MessageHistory& history, const char* sender, size_t sender_length, const char* text, size_t text_length, uint32_t flags, int64_t timestamp);
+size_t history_push(MessageHistory& history, const char* sender, size_t sender_length, const char* text, size_t text_length, uint32_t flags);
+size_t history_page_at(const MessageHistory& history, int y);
+uint32_t page_message_at(const HistoryPage& page, int y);
+size_t history_count_below(const MessageHistory& history, int y);
+
+void history_visible(MessageHistory& history, int view_top, int view_bottom, std::vector<VisibleMessage>& out);
+bool history_locate(const MessageHistory& history, size_t message, size_t* page_out, uint32_t* slot_out);
+std::string snapshot_path(const std::string& username);
+bool history_save_snapshot(const MessageHistory& history, const std::string& path, uint64_t ring_next);
+bool history_load_snapshot(MessageHistory& history, const std::string& path, uint64_t* ring_next);
+
+// Full-text search: an inverted index from lowercased word tokens to the
+// sorted history indexes of the messages containing them. Messages are added
+// as they are ingested, so posting lists mostly grow at the end; messages
+// restored from a snapshot are backfilled with what is left of each frame's
+// ingest budget, oldest first.
+struct SearchIndex {
+    std::unordered_map<std::string, std::vector<uint32_t> > postings;
+    size_t indexed;             // Messages added so far, live and backfilled
+    size_t backfill_next;       // Next restored message to index
+    size_t backfill_end;
+};
+
+void search_tokenize(const char* text, size_t length, std::vector<std::string>& tokens);
+void search_index_add(SearchIndex& index, size_t message, const char* text, size_t length);
+void search_index_backfill(SearchIndex& index, const MessageHistory& history, int64_t deadline);
+void search_query(const SearchIndex& index, const MessageHistory& history, const std::string& query, std::vector<uint32_t>& out);
+
+// Worker pool shared by the background searches. Tasks are plain closures
+// run in submission order by a fixed set of threads.
+struct PoolTask {
+    const void* owner;          // Lets the submitter cancel it while queued
+    std::function<void()> run;
+};
+
+struct ThreadPool {
+    std::vector<std::thread> threads;
+    std::deque<PoolTask> tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+void pool_start(ThreadPool& pool);
+void pool_submit(ThreadPool& pool, const std::function<void()>& task, const void* owner = NULL);
+size_t pool_cancel(ThreadPool& pool, const void* owner);
+void pool_stop(ThreadPool& pool);
+extern ThreadPool worker_pool;
+
+// Substring filter: a case-insensitive brute-force scan over the arena
+// blocks, which already hold the history text packed contiguously. Blocks
+// are handed out to pool workers; each worker finds candidates by testing
+// the first and last needle byte 16 or 32 positions at a time, verifies them,
+// and streams matching history indexes back for the UI to merge.
+struct ScanPage {
+    const char* text;       // Resident block, or NULL to read it from the spill file
+    long spill_offset;
+    uint32_t text_used;
+    const uint32_t* text_offsets;
+    uint32_t count;
+    size_t first;
+};
+
+struct SubstringScan {
+    std::string needle;                     // Lowercased
+    std::vector<ScanPage> pages;            // Snapshot taken when the scan starts
+    int spill_fd;
+    bool holding;                           // History blocks held for the workers
+    std::atomic<size_t> next_page;
+    std::atomic<int> running;
+    std::atomic<bool> cancel;
+    std::mutex lock;
+    std::vector<uint32_t> found;            // Matches not yet taken by the UI
+    size_t scanned;                         // History size covered by the scan
+};
+
+void scan_stop(SubstringScan& scan, MessageHistory& history);
+void scan_start(SubstringScan& scan, MessageHistory& history, const std::string& query);
+void scan_drain(SubstringScan& scan, MessageHistory& history, std::vector<uint32_t>& matches);
+
+// CRC32C (Castagnoli) over ring slots and archive records, so a crashed or
+// buggy writer cannot get garbage displayed or replayed. Uses the SSE4.2
+// crc32 instruction when the CPU has it, a table otherwise. Calls chain like
+// zlib's crc32(): pass the previous result to continue a checksum.
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const void* data, size_t length);
+extern Crc32cFn crc32c;
+uint32_t crc32c_software(uint32_t crc, const void* data, size_t length);
+
+// Archive log: segments of framed records, the active one appended by the
+// process holding the archive directory lock; see chat_client.cpp
+struct ArchiveRecord {
+    uint32_t size;              // Sender plus text bytes following the header
+    uint16_t sender_length;
+    uint16_t flags;
+    uint64_t seq;
+    uint64_t ring_seq;          // Position the message was published at on the ring
+    int64_t timestamp;
+    uint32_t crc;               // CRC32C of the header with crc zeroed, then the bytes
+    uint32_t reserved;
+};
+
+struct SegmentSummary {
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int64_t min_timestamp;
+    int64_t max_timestamp;
+    uint32_t count;
+    std::vector<std::string> senders;
+    std::unordered_set<uint64_t> tokens;    // Distinct token hashes while the segment is written
+    std::vector<uint8_t> bloom;             // Of tokens, once written or read back
+    uint32_t bloom_hashes;
+};
+
+// Appends are dropped until archive_claim succeeds; the receiver claims it
+// once it reads the ring, so an offline client never holds the lock
+struct Archive {
+    std::string dir;
+    int lock_fd = -1;           // -1 when another process writes the archive
+    int segment_fd = -1;        // Active segment, writer thread only
+    std::string segment_path;
+    size_t segment_size;
+    SegmentSummary summary;     // Of the active segment, writer thread only
+
+    std::thread writer;
+    std::mutex lock;            // Guards next_seq, pending, stopping and maintenance_requested
+    std::condition_variable wake;
+    uint64_t next_seq;
+    std::string pending;        // Encoded records waiting for the next commit
+    bool stopping;
+    std::atomic<uint64_t> durable_seq;
+    std::atomic<uint64_t> commits;
+
+    int64_t retention_ms;       // 0 keeps messages forever
+    uint64_t max_bytes;         // Disk cap for the archive, 0 for none
+    std::thread maintainer;     // Retention, size cap and compression of closed segments
+    std::condition_variable maintain_wake;
+    bool maintenance_requested;
+};
+
+std::vector<std::string> archive_segments(const std::string& dir);
+void record_encode(std::string& out, uint64_t seq, uint64_t ring_seq, int64_t timestamp, const char* sender, size_t sender_length, const char* text, size_t text_length);
+extern std::atomic<uint64_t> archive_corrupt;
+bool archive_claim(Archive& archive);
+void archive_open(Archive& archive);
+void archive_shutdown(Archive& archive);
+uint64_t archive_append(Archive& archive, const char* sender, size_t sender_length, const char* text, size_t text_length, int64_t timestamp, uint64_t ring_seq);
+
+// Archive search: segments are mmapped and scanned on the worker pool, after
+// their summaries have ruled out the ones that cannot match. Query terms are
+// words, plus optional from:name, after:YYYY-MM-DD and before:YYYY-MM-DD.
+struct ArchiveQuery {
+    std::vector<std::string> words;
+    std::string sender;
+    int64_t after;
+    int64_t before;
+};
+
+struct ArchiveSearch {
+    ArchiveQuery query;
+    std::vector<std::string> segments;
+    std::atomic<size_t> next_segment;
+    std::atomic<int> running;
+    std::atomic<bool> cancel;
+    std::atomic<size_t> matched;
+    std::atomic<size_t> skipped;            // Segments ruled out by their summary
+    std::mutex lock;
+    std::vector<ArchiveHit> found;          // Hits not yet taken by the UI
+};
+
+void archive_search_stop(ArchiveSearch& search);
+void archive_search_start(ArchiveSearch& search, const Archive& archive, const std::string& text);
+bool archive_search_drain(ArchiveSearch& search, std::vector<ArchiveHit>& hits);
+
+// Client state
+extern MessageHistory chat_messages;
+extern SearchIndex search_index;
+extern SubstringScan substring_scan;
+extern Archive chat_archive;
+extern ArchiveSearch archive_search;
+extern uint32_t my_client_id;
+
+// Shared memory layout: a ring of message slots. Writers reserve a sequence
+// number with one atomic increment of head and publish into slot seq %
+// RING_SLOTS; each reader keeps its own cursor, so no message is missed
+// unless a reader falls a whole ring behind. A slot's seq field works as a
+// seqlock: SLOT_BUSY while being written, seq + 1 once committed. Idle
+// readers sleep on a futex in the segment that publishers bump and wake.
+// Chat clients also post their position in a reader table, so a sender can
+// hold back a burst until the slowest of them has made room for it.
+#define SLOT_BUSY UINT64_MAX
+
+struct RingSlot {
+    std::atomic<uint64_t> seq;
+    uint32_t length;
+    uint32_t writer;
+    int64_t timestamp;          // Publish time, milliseconds since the epoch
+    uint32_t crc;               // CRC32C of the other fields and data
+    uint32_t client_seq;        // Writer's own send counter, confirms its local echo
+    int64_t sent_us;            // When the writer sent it, wall clock microseconds
+    char data[MESSAGE_MAX];
+};
+
+struct RingReader {
+    std::atomic<uint32_t> pid;          // Owning process, 0 while free
+    std::atomic<uint64_t> position;     // Next sequence number it will read
+};
+
+struct ShmRing {
+    std::atomic<uint64_t> head;     // Next sequence number to reserve
+    std::atomic<uint32_t> wake;     // Futex word, bumped on every publish
+    std::atomic<uint32_t> sleepers; // Readers waiting on wake
+    RingReader readers[RING_READERS];
+    RingSlot slots[RING_SLOTS];
+};
+
+struct RingMessage {
+    uint64_t seq;
+    uint32_t writer;
+    uint32_t client_seq;
+    int64_t timestamp;
+    int64_t sent_us;
+    uint32_t length;
+    char data[MESSAGE_MAX];
+};
+
+// One reader's position in the ring
+struct RingCursor {
+    uint64_t next;              // Next sequence number to read
+    uint64_t lost;              // Messages overwritten before they were read
+    uint64_t corrupt;           // Messages dropped for a bad checksum
+    int64_t stalled_ms;         // now_ms() since next was seen reserved but uncommitted, 0 if not
+};
+
+extern RingCursor ring_cursor;
+key_t get_key();
+int share_memory(key_t shm_key);
+char* shm_access(int shm_id);
+void shm_cleanup(char* shm_ptr);
+
+// One message of a batch write
+struct RingPayload {
+    uint32_t client_seq;
+    int64_t sent_us;
+    const char* data;
+    size_t length;
+};
+
+uint64_t ring_write_batch(ShmRing* ring, uint32_t writer, const RingPayload* payloads, size_t count);
+void ring_notify(ShmRing* ring);
+uint64_t ring_publish(ShmRing* ring, uint32_t writer, uint32_t client_seq, const char* data, size_t length);
+void ring_wait(ShmRing* ring, uint64_t cursor, int timeout_ms);
+bool ring_next(ShmRing* ring, RingCursor& reader, RingMessage& out);
+int ring_reader_attach(ShmRing* ring, uint64_t position);
+void ring_reader_detach(ShmRing* ring, int reader);
+uint64_t ring_slowest_reader(ShmRing* ring, uint64_t head);
+
+// Sends go through an outbound queue serviced by a sender thread, so the UI
+// never waits on the transport. The message is shown at once as pending and
+// confirmed when the receiver sees it come back on the ring. An echo confirms
+// only its own send; one lost in the ring stays pending.
+//
+// Without a ring (the segment could not be attached) the sender appends what
+// it takes to an outbox file instead. Once the ring is connected the outbox
+// is published in one burst with a single wakeup and then truncated; a crash
+// in between sends those messages again rather than losing them.
+struct OutboundMessage {
+    uint32_t client_seq;
+    int64_t sent_us;                    // When send_message queued it
+    std::string text;
+};
+
+struct SendQueue {
+    std::atomic<ShmRing*> ring;         // NULL while offline
+    std::thread thread;
+    std::mutex lock;                    // Guards queue and stopping
+    std::condition_variable wake;
+    std::deque<OutboundMessage> queue;
+    bool stopping;
+    int outbox_fd;                      // Sender thread only once started
+    std::vector<OutboundMessage> stored;    // Written to the outbox, not yet published
+    std::atomic<size_t> outbox_count;
+    uint32_t next_client_seq;           // UI thread only
+    std::deque<std::pair<uint32_t, size_t> > pending;   // client_seq, history index; UI thread only
+};
+
+extern SendQueue send_queue;
+std::string outbox_path(const std::string& username);
+void sender_start(SendQueue& sender, ShmRing* ring, const std::string& outbox);
+void sender_connect(SendQueue& sender, ShmRing* ring);
+void sender_stop(SendQueue& sender);
+void confirm_sent(SendQueue& sender, uint32_t client_seq);
+void send_message(SendQueue& sender, const std::string& message);
+
+// Receiver thread: drains the ring, checks and parses messages, works out
+// their list layout (flags and so bubble height), feeds the archive log and
+// hands finished items to the UI thread through a single-producer
+// single-consumer queue, so the render loop only splices them into the
+// history. Glyph layout stays on the UI thread since it rasterizes into the
+// GL atlas; it is still done lazily for the messages that get drawn.
+struct IngestItem {
+    uint64_t seq;
+    int64_t timestamp;
+    uint32_t flags;
+    uint32_t client_seq;                // Of a MSG_ECHO item
+    int64_t sent_us;
+    uint32_t sender_length;
+    uint32_t text_length;
+    char data[MESSAGE_MAX];             // Sender then text, not terminated
+};
+
+struct IngestQueue {
+    IngestItem* items;                  // INGEST_QUEUE_SLOTS of them
+    alignas(64) std::atomic<size_t> head;       // Next to pop, UI thread only
+    alignas(64) std::atomic<size_t> tail;       // Next to push, receiver only
+};
+
+struct Receiver {
+    ShmRing* ring;
+    IngestQueue queue;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> position;     // Copy of ring_cursor.next for other threads
+    int reader;                         // Entry in the ring's reader table, -1 if it was full or not taken yet
+    bool catchup;                       // Catch up before reading the ring, see receiver_start
+    uint64_t catchup_since;
+    size_t catchup_limit;
+};
+
+extern Receiver receiver;
+IngestItem* ingest_queue_reserve(IngestQueue& queue);
+void ingest_queue_push(IngestQueue& queue);
+bool receiver_parse(const RingMessage& msg, IngestItem& item);
+void receiver_start(Receiver& receiver, ShmRing* ring, bool catchup, uint64_t since, size_t limit);
+void receiver_stop(Receiver& receiver);
+size_t ingest_backlog(const IngestQueue& queue);
+size_t check_messages(IngestQueue& queue, int64_t deadline, const std::vector<ChatSubscriber>& subscribers);
+
+// Archive log reads for scroll-up pagination and late joiner catch-up
+void log_fetch(const std::string& dir, uint64_t lo, uint64_t hi, size_t limit, std::vector<ArchiveHit>& out);
+uint64_t log_seq_before(const std::string& dir, int64_t timestamp);
+std::string catch_up(ShmRing* ring, const std::string& dir, uint64_t since, size_t limit, RingCursor& cursor);
+void ingest_batch(const std::string& batch);
+
+#endif
@@ -2,109 +2,821 @@
 
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
+#include "rlgl.h"
+
+#include "chat_client.h"
 
 #include <iostream>
 #include <cstring>
-#include <vector>
-#include <string>
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <unistd.h>
-
-#define SHM_SIZE 1024
-
-// Message structure
-struct Message {
-    std::string sender;
-    std::string text;
-    bool is_mine;
-};
+#include <cstdlib>
+#include <cctype>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#define ATLAS_SIZE 1024
+#define GLYPH_RASTER_SIZE 20     // Pixel size glyphs are rasterized at, drawn scaled
+#define GLYPH_CELL_SIZE 24
+#define RUN_CACHE_LIMIT 2048
+
+#define SEARCH_INDEX 0
+#define SEARCH_SCAN 1
+#define SEARCH_ARCHIVE 2
+#define OLDER_PAGE_MESSAGES 200  // Messages per page fetched from the log on scroll-up
+#define PREFETCH_PIXELS 1200     // Fetch when the view comes this close to unloaded history
+#define OLDER_KEEP_PIXELS 4000   // Older pages farther than this from the view are dropped
+#define BUBBLE_HEIGHT 30
+#define LATENCY_DUMP_MS 60000    // Latency histograms are written this often and on exit
+#define LATENCY_UNDRAWN_MAX 4096 // Messages waiting for their first draw, tracked at most
+#define LATENCY_UNDRAWN_US 10000000  // Not drawn within this long, no longer tracked
+#define HUD_FRAMES 120           // Frames the performance HUD averages over
 
 // Global variables
-std::vector<Message> chat_messages;
-std::string my_username;
-std::string last_message = "";
 float scroll_offset = 0;
 
-// Shared memory functions (from your shared_memo)
-key_t get_key() {
-    key_t shm_key = ftok("shmfile", 65);
-    return shm_key;
+// Heap allocations by any thread, for the performance HUD. The default
+// operator delete frees with free(), which matches; kept out of line so the
+// compiler does not pair the malloc() with delete sites.
+std::atomic<uint64_t> allocation_count(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// Performance HUD, toggled with F1: frame, ingest, layout and draw times over
+// the last HUD_FRAMES frames, messages drawn versus culled, allocations per
+// frame and how far this client is behind the ring. Hidden, it costs one
+// branch per phase; the timers only run while it is shown.
+struct PerfSample {
+    int64_t frame_us;           // Start of one frame to the start of the next
+    int64_t ingest_us;          // chat_poll() and search backfill
+    int64_t layout_us;          // Glyph run layout, a part of draw
+    int64_t draw_us;            // Collecting and flushing the message list
+    uint32_t drawn;
+    uint32_t culled;
+    uint64_t allocations;
+};
+
+struct PerfHud {
+    bool visible;
+    PerfSample samples[HUD_FRAMES];
+    size_t count;               // Samples recorded, up to HUD_FRAMES are kept
+    PerfSample current;
+    int64_t frame_start;
+    uint64_t allocations_start;
+};
+
+PerfHud perf_hud;
+
+// Glyph atlas: codepoints are rasterized from a TTF font the first time they
+// are used and packed into fixed-size cells of one texture. When every cell
+// is taken, the glyph drawn least recently is evicted and its cell reused.
+struct AtlasCell {
+    int codepoint;              // -1 while the cell is free
+    unsigned int generation;    // Bumped every time the cell is reused
+    unsigned int last_used;     // Frame the glyph was last drawn in
+    float offset_x, offset_y;
+    float width, height;
+};
+
+struct GlyphAtlas {
+    Texture2D texture;
+    unsigned char* font_data;   // NULL when no TTF was found
+    int font_data_size;
+    int columns;
+    std::vector<AtlasCell> cells;               // Cell 0 is solid white, used for shapes
+    std::unordered_map<int, int> cell_of;       // codepoint -> cell
+    std::unordered_map<int, float> advance_of;  // codepoint -> advance, kept across evictions
+    std::vector<unsigned char> scratch;
+    unsigned int frame;
+};
+
+GlyphAtlas glyph_atlas;
+
+Rectangle atlas_cell_rec(const GlyphAtlas& atlas, int cell) {
+    return (Rectangle){ (float)((cell % atlas.columns) * GLYPH_CELL_SIZE),
+                        (float)((cell / atlas.columns) * GLYPH_CELL_SIZE),
+                        GLYPH_CELL_SIZE, GLYPH_CELL_SIZE };
 }
 
-int share_memory(key_t shm_key) {
-    int shm_id = shmget(shm_key, SHM_SIZE, 0666 | IPC_CREAT);
-    if (shm_id == -1) {
-        std::cerr << "Failed to access shared memory" << std::endl;
-        return -1;
+bool atlas_load(GlyphAtlas& atlas) {
+    const char* candidates[] = {
+        getenv("CHAT_FONT"),
+        "/usr/share/fonts/truetype/noto/NotoSans-Regular.ttf",
+        "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+        "/usr/share/fonts/TTF/DejaVuSans.ttf",
+        "/usr/share/fonts/dejavu/DejaVuSans.ttf",
+        "/usr/share/fonts/truetype/freefont/FreeSans.ttf",
+    };
+
+    atlas.font_data = NULL;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if (candidates[i] != NULL && FileExists(candidates[i])) {
+            atlas.font_data = LoadFileData(candidates[i], &atlas.font_data_size);
+            if (atlas.font_data != NULL) break;
+        }
+    }
+    if (atlas.font_data == NULL) {
+        std::cerr << "No TTF font found (set CHAT_FONT), using the default font" << std::endl;
+        return false;
     }
-    return shm_id;
+
+    Image blank = GenImageColor(ATLAS_SIZE, ATLAS_SIZE, BLANK);
+    atlas.texture = LoadTextureFromImage(blank);
+    UnloadImage(blank);
+    SetTextureFilter(atlas.texture, TEXTURE_FILTER_BILINEAR);
+
+    atlas.columns = ATLAS_SIZE / GLYPH_CELL_SIZE;
+    AtlasCell free_cell = { -1, 0, 0, 0, 0, 0, 0 };
+    atlas.cells.assign(atlas.columns * atlas.columns, free_cell);
+    atlas.scratch.assign(GLYPH_CELL_SIZE * GLYPH_CELL_SIZE * 4, 255);
+    atlas.frame = 0;
+
+    // Reserve cell 0 as a solid block so shapes share the glyph texture
+    UpdateTextureRec(atlas.texture, atlas_cell_rec(atlas, 0), atlas.scratch.data());
+    atlas.cells[0].codepoint = -2;
+    return true;
 }
 
-char* shm_access(int shm_id) {
-    char* shm_ptr = (char*)shmat(shm_id, NULL, 0);
-    return shm_ptr;
+// Pick a free cell, or the least recently drawn one
+int atlas_take_cell(GlyphAtlas& atlas) {
+    int victim = -1;
+    for (size_t i = 1; i < atlas.cells.size(); i++) {
+        const AtlasCell& cell = atlas.cells[i];
+        if (cell.codepoint == -1) return (int)i;
+        if (victim == -1 || cell.last_used < atlas.cells[victim].last_used) victim = (int)i;
+    }
+
+    atlas.cell_of.erase(atlas.cells[victim].codepoint);
+    atlas.cells[victim].codepoint = -1;
+    return victim;
 }
 
-void shm_cleanup(int shm_id, char* shm_ptr) {
-    if (shmdt(shm_ptr) == -1) {
-        std::cerr << "Failed to detach shared memory" << std::endl;
+// Cell holding the codepoint, rasterizing it on a miss
+int atlas_glyph(GlyphAtlas& atlas, int codepoint) {
+    std::unordered_map<int, int>::iterator found = atlas.cell_of.find(codepoint);
+    if (found != atlas.cell_of.end()) {
+        atlas.cells[found->second].last_used = atlas.frame;
+        return found->second;
+    }
+
+    int index = atlas_take_cell(atlas);
+    AtlasCell& cell = atlas.cells[index];
+    cell.codepoint = codepoint;
+    cell.generation++;
+    cell.last_used = atlas.frame;
+    cell.offset_x = cell.offset_y = cell.width = cell.height = 0;
+    atlas.cell_of[codepoint] = index;
+
+    GlyphInfo* info = LoadFontData(atlas.font_data, atlas.font_data_size, GLYPH_RASTER_SIZE, &codepoint, 1, FONT_DEFAULT);
+    if (info == NULL) {
+        atlas.advance_of[codepoint] = 0;
+        return index;
     }
+
+    // Copy the grayscale coverage into the cell as white with alpha, leaving
+    // a one texel gutter so bilinear filtering never bleeds between cells
+    int width = info->image.width < GLYPH_CELL_SIZE - 2 ? info->image.width : GLYPH_CELL_SIZE - 2;
+    int height = info->image.height < GLYPH_CELL_SIZE - 2 ? info->image.height : GLYPH_CELL_SIZE - 2;
+    const unsigned char* coverage = (const unsigned char*)info->image.data;
+
+    memset(atlas.scratch.data(), 0, atlas.scratch.size());
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char* texel = &atlas.scratch[((y + 1) * GLYPH_CELL_SIZE + x + 1) * 4];
+            texel[0] = texel[1] = texel[2] = 255;
+            texel[3] = coverage[y * info->image.width + x];
+        }
+    }
+    UpdateTextureRec(atlas.texture, atlas_cell_rec(atlas, index), atlas.scratch.data());
+
+    cell.offset_x = (float)info->offsetX;
+    cell.offset_y = (float)info->offsetY;
+    cell.width = (float)width;
+    cell.height = (float)height;
+    atlas.advance_of[codepoint] = (float)(info->advanceX != 0 ? info->advanceX : info->image.width);
+
+    UnloadFontData(info, 1);
+    return index;
 }
 
-// Read messages from shared memory
-void check_messages(char* shm_ptr) {
-    std::string current_message(shm_ptr);
+// Positioned glyphs of one piece of text, in raster pixels. UTF-8 is decoded
+// and advances are resolved once; cells are re-resolved only after eviction.
+struct RunGlyph {
+    int codepoint;
+    int cell;
+    unsigned int generation;
+    float x;
+};
 
-    if (!current_message.empty() && current_message != last_message) {
-        // Parse message "sender: text"
-        size_t colon_pos = current_message.find(": ");
+struct GlyphRun {
+    std::vector<RunGlyph> glyphs;
+    float width;
+};
 
-        if (colon_pos != std::string::npos) {
-            Message msg;
-            msg.sender = current_message.substr(0, colon_pos);
-            msg.text = current_message.substr(colon_pos + 2);
-            msg.is_mine = (msg.sender == my_username);
+struct MessageRuns {
+    GlyphRun sender;
+    GlyphRun text;
+    unsigned int last_used;
+};
 
-            chat_messages.push_back(msg);
-            last_message = current_message;
+std::unordered_map<size_t, MessageRuns> run_cache;    // message index -> runs
+
+void layout_run(GlyphAtlas& atlas, GlyphRun& run, const char* text) {
+    TRACE_SPAN("layout");
+    int64_t start = perf_hud.visible ? now_us() : 0;
+    run.glyphs.clear();
+    run.width = 0;
+    int size = 0;
+
+    for (int i = 0; text[i] != '\0'; i += size) {
+        int codepoint = GetCodepointNext(&text[i], &size);
+        int cell = atlas_glyph(atlas, codepoint);
+
+        if (codepoint != ' ' && codepoint != '\t') {
+            RunGlyph glyph = { codepoint, cell, atlas.cells[cell].generation, run.width };
+            run.glyphs.push_back(glyph);
         }
+        run.width += atlas.advance_of[codepoint];
+    }
+    if (perf_hud.visible) perf_hud.current.layout_us += now_us() - start;
+}
+
+MessageRuns& message_runs(size_t index, const char* sender, const char* text) {
+    std::unordered_map<size_t, MessageRuns>::iterator found = run_cache.find(index);
+    if (found == run_cache.end()) {
+        MessageRuns& runs = run_cache[index];
+        layout_run(glyph_atlas, runs.sender, sender);
+        layout_run(glyph_atlas, runs.text, text);
+        found = run_cache.find(index);
     }
+    found->second.last_used = glyph_atlas.frame;
+    return found->second;
 }
 
-// Send message to shared memory
-void send_message(char* shm_ptr, const std::string& message) {
-    if (message.empty()) return;
+// Drop runs of messages that scrolled out of view once the cache is full
+void trim_run_cache() {
+    if (run_cache.size() <= RUN_CACHE_LIMIT) return;
 
-    std::string full_message = my_username + ": " + message;
-    strncpy(shm_ptr, full_message.c_str(), SHM_SIZE - 1);
-    shm_ptr[SHM_SIZE - 1] = '\0';
+    for (std::unordered_map<size_t, MessageRuns>::iterator it = run_cache.begin(); it != run_cache.end();) {
+        if (it->second.last_used != glyph_atlas.frame) it = run_cache.erase(it);
+        else ++it;
+    }
+}
+
+// Batched drawing: the visible part of the chat is collected into one quad
+// list and submitted to rlgl in a single pass, instead of issuing separate
+// DrawRectangle/DrawRectangleLines/DrawText calls for every bubble
+struct Quad {
+    Rectangle dst;
+    Rectangle src;     // Texel rectangle inside the batch texture
+    Color color;
+};
+
+struct DrawBatch {
+    Texture2D texture;     // Font atlas, bubbles sample its solid white texel
+    Rectangle white_rec;
+    std::vector<Quad> quads;
+};
 
-    // Add to our own messages
-    Message msg;
-    msg.sender = my_username;
-    msg.text = message;
-    msg.is_mine = true;
-    chat_messages.push_back(msg);
+DrawBatch message_batch;
 
-    last_message = full_message;
+void batch_init(DrawBatch& batch, const GlyphAtlas& atlas) {
+    if (atlas.font_data != NULL) {
+        batch.texture = atlas.texture;
+        batch.white_rec = (Rectangle){ GLYPH_CELL_SIZE / 2, GLYPH_CELL_SIZE / 2, 1, 1 };
+    } else {
+        Font font = GetFontDefault();
+        batch.texture = font.texture;
+        // Same texel raylib uses for shapes: inside the solid block glyph (index 95)
+        batch.white_rec = (Rectangle){ font.recs[95].x + 2, font.recs[95].y + 2, 1, 1 };
+    }
+    batch.quads.reserve(4096);
 }
 
-int main(int argc, char* argv[]) {
-    // Get username
-    if (argc > 1) {
-        my_username = argv[1];
+void batch_rect(DrawBatch& batch, float x, float y, float width, float height, Color color) {
+    Quad quad;
+    quad.dst = (Rectangle){ x, y, width, height };
+    quad.src = batch.white_rec;
+    quad.color = color;
+    batch.quads.push_back(quad);
+}
+
+// Same pixel coverage as DrawRectangleLines(): four one pixel wide strips
+void batch_rect_lines(DrawBatch& batch, float x, float y, float width, float height, Color color) {
+    batch_rect(batch, x, y, width, 1, color);
+    batch_rect(batch, x, y + height - 1, width, 1, color);
+    batch_rect(batch, x, y + 1, 1, height - 2, color);
+    batch_rect(batch, x + width - 1, y + 1, 1, height - 2, color);
+}
+
+// Lays out text with the default font exactly like DrawText() does
+void batch_text(DrawBatch& batch, const char* text, float x, float y, int font_size, Color color) {
+    Font font = GetFontDefault();
+    if (font_size < 10) font_size = 10;
+
+    float scale = (float)font_size / font.baseSize;
+    float spacing = (float)(font_size / 10);
+    float pad = (float)font.glyphPadding;
+    float offset_x = 0;
+    int size = 0;
+
+    for (int i = 0; text[i] != '\0'; i += size) {
+        int codepoint = GetCodepointNext(&text[i], &size);
+        int index = GetGlyphIndex(font, codepoint);
+        const Rectangle& rec = font.recs[index];
+        const GlyphInfo& glyph = font.glyphs[index];
+
+        if (codepoint != ' ' && codepoint != '\t') {
+            Quad quad;
+            quad.dst = (Rectangle){ x + offset_x + (glyph.offsetX - pad) * scale, y + (glyph.offsetY - pad) * scale,
+                                    (rec.width + 2 * pad) * scale, (rec.height + 2 * pad) * scale };
+            quad.src = (Rectangle){ rec.x - pad, rec.y - pad, rec.width + 2 * pad, rec.height + 2 * pad };
+            quad.color = color;
+            batch.quads.push_back(quad);
+        }
+
+        offset_x += ((glyph.advanceX == 0) ? rec.width : (float)glyph.advanceX) * scale + spacing;
+    }
+}
+
+// Glyph quads of a laid out run, scaled from the raster size to font_size
+void batch_run(DrawBatch& batch, GlyphAtlas& atlas, GlyphRun& run, float x, float y, int font_size, Color color) {
+    float scale = (float)font_size / GLYPH_RASTER_SIZE;
+
+    for (size_t i = 0; i < run.glyphs.size(); i++) {
+        RunGlyph& glyph = run.glyphs[i];
+        if (atlas.cells[glyph.cell].generation != glyph.generation ||
+            atlas.cells[glyph.cell].codepoint != glyph.codepoint) {
+            glyph.cell = atlas_glyph(atlas, glyph.codepoint);
+            glyph.generation = atlas.cells[glyph.cell].generation;
+        }
+        AtlasCell& cell = atlas.cells[glyph.cell];
+        cell.last_used = atlas.frame;
+
+        Rectangle rec = atlas_cell_rec(atlas, glyph.cell);
+        Quad quad;
+        quad.dst = (Rectangle){ x + (glyph.x + cell.offset_x) * scale, y + cell.offset_y * scale,
+                                cell.width * scale, cell.height * scale };
+        quad.src = (Rectangle){ rec.x + 1, rec.y + 1, cell.width, cell.height };
+        quad.color = color;
+        batch.quads.push_back(quad);
+    }
+}
+
+// Submit every collected quad with one texture bind; chunks only keep each
+// rlBegin()/rlEnd() pair inside the rlgl vertex buffer
+void batch_flush(DrawBatch& batch) {
+    const size_t chunk = 1024;
+    float tex_w = (float)batch.texture.width;
+    float tex_h = (float)batch.texture.height;
+
+    for (size_t start = 0; start < batch.quads.size(); start += chunk) {
+        size_t end = start + chunk;
+        if (end > batch.quads.size()) end = batch.quads.size();
+
+        rlCheckRenderBatchLimit((int)(end - start) * 4);
+        rlSetTexture(batch.texture.id);
+        rlBegin(RL_QUADS);
+
+        for (size_t i = start; i < end; i++) {
+            const Quad& q = batch.quads[i];
+            float u0 = q.src.x / tex_w, v0 = q.src.y / tex_h;
+            float u1 = (q.src.x + q.src.width) / tex_w, v1 = (q.src.y + q.src.height) / tex_h;
+
+            rlColor4ub(q.color.r, q.color.g, q.color.b, q.color.a);
+            rlTexCoord2f(u0, v0); rlVertex2f(q.dst.x, q.dst.y);
+            rlTexCoord2f(u0, v1); rlVertex2f(q.dst.x, q.dst.y + q.dst.height);
+            rlTexCoord2f(u1, v1); rlVertex2f(q.dst.x + q.dst.width, q.dst.y + q.dst.height);
+            rlTexCoord2f(u1, v0); rlVertex2f(q.dst.x + q.dst.width, q.dst.y);
+        }
+
+        rlEnd();
+    }
+
+    rlSetTexture(0);
+    batch.quads.clear();
+}
+
+// Collects one chat bubble into the message batch. runs is NULL when no TTF
+// font is loaded and the default font is used.
+void draw_message(Rectangle area, int y_pos, const char* sender, const char* text,
+                  uint32_t flags, bool is_match, MessageRuns* runs) {
+    bool is_mine = (flags & MSG_MINE) != 0;
+
+    // Calculate message box dimensions
+    int text_width;
+    if (runs != NULL) {
+        text_width = (int)(runs->text.width * 10 / GLYPH_RASTER_SIZE);
     } else {
-        my_username = "User";
+        text_width = MeasureText(text, 10);
+    }
+    int msg_width = text_width + 20;
+    if (msg_width > area.width - 60) msg_width = area.width - 60;
+    int box_height = BUBBLE_HEIGHT;
+
+    int msg_x;
+    Color box_color;
+
+    if (is_mine) {
+        // My messages on the right (green, paler until seen on the ring)
+        msg_x = area.x + area.width - msg_width - 10;
+        box_color = (flags & MSG_PENDING) ? (Color){228, 245, 228, 255} : (Color){200, 255, 200, 255};
+    } else {
+        // Their messages on the left (white)
+        msg_x = area.x + 10;
+        box_color = WHITE;
+    }
+
+    // Message box
+    if (is_match) box_color = (Color){255, 240, 150, 255};
+    batch_rect(message_batch, msg_x, y_pos, msg_width, box_height, box_color);
+    batch_rect_lines(message_batch, msg_x, y_pos, msg_width, box_height, is_match ? ORANGE : GRAY);
+
+    // Message text
+    int text_y = is_mine ? y_pos + 5 : y_pos + 12;
+    Color text_color = (flags & MSG_PENDING) ? GRAY : BLACK;
+    if (runs != NULL) {
+        // Show sender name for others
+        if (!is_mine) batch_run(message_batch, glyph_atlas, runs->sender, msg_x + 5, y_pos + 2, 8, DARKGRAY);
+        batch_run(message_batch, glyph_atlas, runs->text, msg_x + 10, text_y, 10, text_color);
+    } else {
+        if (!is_mine) batch_text(message_batch, sender, msg_x + 5, y_pos + 2, 8, DARKGRAY);
+        batch_text(message_batch, text, msg_x + 10, text_y, 10, text_color);
+    }
+}
+
+// Archive search results replace the message list while an archive query is
+// active, newest first
+void draw_archive_hits(const std::vector<ArchiveHit>& hits, std::vector<MessageRuns>& runs,
+                       Rectangle area, float scroll) {
+    if (runs.size() != hits.size()) runs.resize(hits.size());
+
+    for (size_t i = (size_t)(scroll / THEIRS_HEIGHT); i < hits.size(); i++) {
+        int y_pos = area.y + 10 + (int)i * THEIRS_HEIGHT - (int)scroll;
+        if (y_pos > area.y + area.height) break;
+
+        const ArchiveHit& hit = hits[i];
+        char when[32];
+        time_t seconds = (time_t)(hit.timestamp / 1000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+        std::string label = std::string(when) + "  " + hit.sender;
+
+        int box_x = area.x + 10;
+        batch_rect(message_batch, box_x, y_pos, area.width - 20, BUBBLE_HEIGHT, WHITE);
+        batch_rect_lines(message_batch, box_x, y_pos, area.width - 20, BUBBLE_HEIGHT, GRAY);
+
+        if (glyph_atlas.font_data != NULL) {
+            MessageRuns& run = runs[i];
+            if (run.sender.glyphs.empty() && run.text.glyphs.empty()) {
+                layout_run(glyph_atlas, run.sender, label.c_str());
+                layout_run(glyph_atlas, run.text, hit.text.c_str());
+            }
+            batch_run(message_batch, glyph_atlas, run.sender, box_x + 5, y_pos + 2, 8, DARKGRAY);
+            batch_run(message_batch, glyph_atlas, run.text, box_x + 10, y_pos + 12, 10, BLACK);
+        } else {
+            batch_text(message_batch, label.c_str(), box_x + 5, y_pos + 2, 8, DARKGRAY);
+            batch_text(message_batch, hit.text.c_str(), box_x + 10, y_pos + 12, 10, BLACK);
+        }
+    }
+}
+
+// Scroll-up pagination: history older than the live list is fetched from
+// the archive log in pages on the worker pool and shown above it, at negative
+// list positions. Fetching starts PREFETCH_PIXELS before the view reaches the
+// top. Pages far from the view drop their messages but keep their sequence
+// range and height, so they are fetched again when scrolled back to without
+// anything below them moving; a refetch that comes back a different height
+// moves only the pages above it.
+struct OlderPage {
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int y;                              // Top, in list coordinates (negative)
+    int height;
+    bool loaded;
+    std::vector<ArchiveHit> messages;   // Oldest first
+    std::vector<int> y_offsets;
+    std::vector<MessageRuns> runs;
+};
+
+struct OlderHistory {
+    std::deque<OlderPage> pages;        // Oldest first, the last one ends at 0
+    int height;
+    uint64_t boundary;                  // Next older page ends before this seq, UINT64_MAX until known
+    bool exhausted;                     // Nothing older left in the log
+
+    std::mutex lock;                    // Guards the result fields
+    std::atomic<bool> busy;             // One fetch in flight at a time
+    bool done;
+    int target;                         // Page being refetched, -1 for a new older page
+    uint64_t result_boundary;
+    std::vector<ArchiveHit> result;
+};
+
+OlderHistory older_history;
+
+void older_init(OlderHistory& older) {
+    older.height = 0;
+    older.boundary = UINT64_MAX;
+    older.exhausted = false;
+    older.busy = false;
+    older.done = false;
+}
+
+void older_submit(OlderHistory& older, ChatClient& client, int target, uint64_t lo, uint64_t hi,
+                  int64_t before_timestamp) {
+    older.busy = true;
+    OlderHistory* shared = &older;
+    size_t limit = target == -1 ? OLDER_PAGE_MESSAGES : SIZE_MAX;
+    chat_fetch_log(client, lo, hi, before_timestamp, limit, [shared, target](uint64_t end, std::vector<ArchiveHit>& messages) {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        shared->target = target;
+        shared->result_boundary = end;
+        shared->result.swap(messages);
+        shared->done = true;
+    });
+}
+
+void older_fill(OlderPage& page, std::vector<ArchiveHit>& messages) {
+    page.messages.swap(messages);
+    page.y_offsets.clear();
+    page.runs.assign(page.messages.size(), MessageRuns());
+
+    int height = 0;
+    for (size_t i = 0; i < page.messages.size(); i++) {
+        page.y_offsets.push_back(height);
+        height += message_height(page.messages[i].sender == my_username ? MSG_MINE : 0);
+    }
+    page.height = height;
+    page.loaded = true;
+}
+
+// Per frame: take a finished fetch, drop pages far from the view and start
+// the next fetch the view is coming close to. Shifts scroll when a refetched
+// page at or below the view top came back a different height.
+void older_update(OlderHistory& older, ChatClient& client, int view_top, int view_bottom, int64_t oldest_timestamp,
+                  float& scroll) {
+    std::vector<ArchiveHit> result;
+    int target = -1;
+    bool done = false;
+    {
+        std::lock_guard<std::mutex> guard(older.lock);
+        if (older.done) {
+            done = true;
+            target = older.target;
+            result.swap(older.result);
+            older.done = false;
+        }
     }
 
-    // Setup shared memory
-    key_t shm_key = get_key();
-    int shm_id = share_memory(shm_key);
-    if (shm_id == -1) {
-        return 1;
+    if (done) {
+        if (target >= 0) {
+            // A refetch can come back a different height (retention dropped a
+            // segment, the username changed). Keep the page's bottom edge, move
+            // it and everything older by the difference, and keep the view on
+            // the same messages when it is looking at any of them.
+            OlderPage& page = older.pages[target];
+            int bottom = page.y + page.height;
+            older_fill(page, result);
+            int delta = page.height - (bottom - page.y);
+            if (delta != 0) {
+                for (int p = 0; p <= target; p++) older.pages[p].y -= delta;
+                older.height += delta;
+                if (view_top < bottom) scroll -= delta;
+            }
+        } else if (result.empty()) {
+            older.exhausted = true;
+        } else {
+            OlderPage page;
+            older_fill(page, result);
+            page.first_seq = page.messages.front().seq;
+            page.last_seq = page.messages.back().seq;
+            older.height += page.height;
+            page.y = -older.height;
+            older.pages.push_front(page);
+            older.boundary = page.first_seq;
+        }
+        older.busy = false;
+    }
+
+    for (size_t p = 0; p < older.pages.size(); p++) {
+        OlderPage& page = older.pages[p];
+        bool far = page.y > view_bottom + OLDER_KEEP_PIXELS || page.y + page.height < view_top - OLDER_KEEP_PIXELS;
+        if (far && page.loaded) {
+            std::vector<ArchiveHit>().swap(page.messages);
+            std::vector<MessageRuns>().swap(page.runs);
+            page.loaded = false;
+        }
+    }
+
+    if (older.busy) return;
+
+    for (size_t p = 0; p < older.pages.size(); p++) {
+        OlderPage& page = older.pages[p];
+        bool near = page.y <= view_bottom + PREFETCH_PIXELS && page.y + page.height >= view_top - PREFETCH_PIXELS;
+        if (near && !page.loaded) {
+            older_submit(older, client, (int)p, page.first_seq, page.last_seq + 1, 0);
+            return;
+        }
     }
-    char* shm_ptr = shm_access(shm_id);
+
+    if (!older.exhausted && view_top - PREFETCH_PIXELS < -older.height) {
+        older_submit(older, client, -1, 0, older.boundary, oldest_timestamp);
+    }
+}
+
+void draw_older_history(OlderHistory& older, Rectangle area, int list_top, int view_top, int view_bottom) {
+    for (size_t p = 0; p < older.pages.size(); p++) {
+        OlderPage& page = older.pages[p];
+        if (page.y + page.height < view_top || page.y > view_bottom || !page.loaded) continue;
+
+        size_t first = std::upper_bound(page.y_offsets.begin(), page.y_offsets.end(), view_top - page.y) -
+                       page.y_offsets.begin();
+        if (first > 0) first--;
+        for (size_t i = first; i < page.messages.size(); i++) {
+            int y_pos = list_top + page.y + page.y_offsets[i];
+            if (y_pos > area.y + area.height) break;
+
+            const ArchiveHit& message = page.messages[i];
+            bool is_mine = message.sender == my_username;
+            MessageRuns* runs = NULL;
+            if (glyph_atlas.font_data != NULL) {
+                runs = &page.runs[i];
+                if (runs->sender.glyphs.empty() && runs->text.glyphs.empty()) {
+                    layout_run(glyph_atlas, runs->sender, message.sender.c_str());
+                    layout_run(glyph_atlas, runs->text, message.text.c_str());
+                }
+            }
+            draw_message(area, y_pos, message.sender.c_str(), message.text.c_str(), is_mine ? MSG_MINE : 0, false, runs);
+        }
+    }
+}
+
+// Close the previous frame's sample and start timing the next frame
+void perf_frame_start(PerfHud& hud) {
+    if (!hud.visible) return;
+    int64_t now = now_us();
+    uint64_t allocations = allocation_count.load(std::memory_order_relaxed);
+    if (hud.frame_start != 0) {
+        hud.current.frame_us = now - hud.frame_start;
+        hud.current.allocations = allocations - hud.allocations_start;
+        hud.samples[hud.count % HUD_FRAMES] = hud.current;
+        hud.count++;
+    }
+    memset(&hud.current, 0, sizeof(hud.current));
+    hud.frame_start = now;
+    hud.allocations_start = allocations;
+}
+
+void perf_toggle(PerfHud& hud) {
+    hud.visible = !hud.visible;
+    hud.count = 0;
+    hud.frame_start = 0;
+}
+
+void draw_perf_hud(const PerfHud& hud, Rectangle area, uint64_t ring_lag, size_t queued) {
+    size_t count = std::min(hud.count, (size_t)HUD_FRAMES);
+    PerfSample total = { 0, 0, 0, 0, 0, 0, 0 };
+    PerfSample peak = { 0, 0, 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < count; i++) {
+        const PerfSample& sample = hud.samples[i];
+        total.frame_us += sample.frame_us;
+        total.ingest_us += sample.ingest_us;
+        total.layout_us += sample.layout_us;
+        total.draw_us += sample.draw_us;
+        total.allocations += sample.allocations;
+        peak.frame_us = std::max(peak.frame_us, sample.frame_us);
+        peak.ingest_us = std::max(peak.ingest_us, sample.ingest_us);
+        peak.layout_us = std::max(peak.layout_us, sample.layout_us);
+        peak.draw_us = std::max(peak.draw_us, sample.draw_us);
+        peak.allocations = std::max(peak.allocations, sample.allocations);
+    }
+    double frames = count > 0 ? (double)count : 1.0;
+    const PerfSample& last = hud.samples[(hud.count + HUD_FRAMES - 1) % HUD_FRAMES];
+
+    GuiPanel(area, "Performance (avg / max)");
+    const char* lines[] = {
+        TextFormat("frame   %.2f / %.2f ms", total.frame_us / frames / 1000, peak.frame_us / 1000.0),
+        TextFormat("ingest  %.2f / %.2f ms", total.ingest_us / frames / 1000, peak.ingest_us / 1000.0),
+        TextFormat("layout  %.2f / %.2f ms", total.layout_us / frames / 1000, peak.layout_us / 1000.0),
+        TextFormat("draw    %.2f / %.2f ms", total.draw_us / frames / 1000, peak.draw_us / 1000.0),
+        TextFormat("drawn %d  culled %d", count > 0 ? (int)last.drawn : 0, count > 0 ? (int)last.culled : 0),
+        TextFormat("allocs/frame  %.1f / %d", total.allocations / frames, (int)peak.allocations),
+        TextFormat("ring lag %d  queued %d", (int)ring_lag, (int)queued),
+    };
+    for (int i = 0; i < 7; i++) {
+        GuiLabel((Rectangle){ area.x + 10, area.y + 28 + i * 18, area.width - 20, 18 }, lines[i]);
+    }
+}
+
+// Latency tracing: every message carries its sender's send time. When a
+// message is spliced into the history the UI records send to ingest, and the
+// first frame it is drawn in records ingest to draw and send to draw. The
+// histograms show in an overlay toggled with F2 and are written to a file.
+struct UndrawnMessage {
+    int64_t ingested_us;        // now_us() time
+    int64_t sent_us;            // Wall clock
+};
+
+struct LatencyTrace {
+    LatencyHistogram send_to_ingest;
+    LatencyHistogram ingest_to_draw;
+    LatencyHistogram send_to_draw;
+    std::unordered_map<size_t, UndrawnMessage> undrawn;     // By history index
+    std::string path;
+    int64_t next_dump;
+    bool overlay;
+};
+
+LatencyTrace latency_trace;
+
+std::string latency_path(const std::string& username) {
+    return user_file_path("CHAT_LATENCY_FILE", "chat_latency_", username, ".txt");
+}
+
+std::string trace_path(const std::string& username) {
+    return user_file_path("CHAT_TRACE_FILE", "chat_trace_", username, ".json");
+}
+
+void latency_trace_start(LatencyTrace& trace, ChatClient& client) {
+    latency_reset(trace.send_to_ingest);
+    latency_reset(trace.ingest_to_draw);
+    latency_reset(trace.send_to_draw);
+    trace.path = latency_path(my_username);
+    trace.next_dump = now_ms() + LATENCY_DUMP_MS;
+    trace.overlay = false;
+
+    LatencyTrace* shared = &trace;
+    chat_subscribe(client, [shared](const ChatEvent& event) {
+        if (event.sent_us <= 0) return;
+        latency_record(shared->send_to_ingest, wall_us() - event.sent_us);
+        if (shared->undrawn.size() < LATENCY_UNDRAWN_MAX) {
+            UndrawnMessage message = { now_us(), event.sent_us };
+            shared->undrawn[event.index] = message;
+        }
+    });
+}
+
+// A message is on screen this frame
+void latency_drawn(LatencyTrace& trace, size_t index) {
+    std::unordered_map<size_t, UndrawnMessage>::iterator found = trace.undrawn.find(index);
+    if (found == trace.undrawn.end()) return;
+    latency_record(trace.ingest_to_draw, now_us() - found->second.ingested_us);
+    latency_record(trace.send_to_draw, wall_us() - found->second.sent_us);
+    trace.undrawn.erase(found);
+}
+
+// Write the histograms, and stop tracking messages that were never drawn
+void latency_dump(LatencyTrace& trace) {
+    int64_t cutoff = now_us() - LATENCY_UNDRAWN_US;
+    for (std::unordered_map<size_t, UndrawnMessage>::iterator it = trace.undrawn.begin(); it != trace.undrawn.end();) {
+        if (it->second.ingested_us < cutoff) it = trace.undrawn.erase(it);
+        else ++it;
+    }
+
+    FILE* file = fopen(trace.path.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Failed to write latencies " << trace.path << std::endl;
+        return;
+    }
+    fprintf(file, "# %s, microseconds\n", my_username.c_str());
+    latency_write(file, "send_to_ingest", trace.send_to_ingest);
+    latency_write(file, "ingest_to_draw", trace.ingest_to_draw);
+    latency_write(file, "send_to_draw", trace.send_to_draw);
+    fclose(file);
+}
+
+void draw_latency_overlay(const LatencyTrace& trace, Rectangle area) {
+    GuiPanel(area, "Latency (us)");
+    const char* names[] = { "send > ingest", "ingest > draw", "send > draw" };
+    const LatencyHistogram* histograms[] = { &trace.send_to_ingest, &trace.ingest_to_draw, &trace.send_to_draw };
+    for (int i = 0; i < 3; i++) {
+        const LatencyHistogram& histogram = *histograms[i];
+        GuiLabel((Rectangle){ area.x + 10, area.y + 30 + i * 20, area.width - 20, 20 },
+                 TextFormat("%s  p50 %lld  p99 %lld  p999 %lld  n %llu", names[i],
+                            (long long)latency_percentile(histogram, 0.5), (long long)latency_percentile(histogram, 0.99),
+                            (long long)latency_percentile(histogram, 0.999), (unsigned long long)histogram.total));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // Get username. Without the shared segment the client runs offline:
+    // sends go to the outbox and the segment is retried every few seconds.
+    ChatClient client;
+    chat_connect(client, argc > 1 ? argv[1] : "User", true);
+    older_init(older_history);
+    latency_trace_start(latency_trace, client);
 
     // Window setup
     const int screenWidth = 700;
@@ -112,101 +824,234 @@ int main(int argc, char* argv[]) {
 
     InitWindow(screenWidth, screenHeight, TextFormat("Chat - %s", my_username.c_str()));
     SetTargetFPS(60);
+    atlas_load(glyph_atlas);
+    batch_init(message_batch, glyph_atlas);
+
+    // Open at the newest messages
+    Rectangle chat_area = { 20, 70, screenWidth - 40, 360 };
+    scroll_offset = chat_history_height(client) + 10 - chat_area.height;
+    if (scroll_offset < 0) scroll_offset = 0;
 
     char message_input[256] = "";
     bool message_edit_mode = false;
 
+    char search_input[128] = "";
+    bool search_edit_mode = false;
+    std::string search_text;
+    size_t search_count = 0;             // Indexed message count the matches were computed at
+    std::vector<uint32_t> search_matches;
+    int search_mode = SEARCH_INDEX;
+    int search_mode_shown = SEARCH_INDEX;
+    std::vector<ArchiveHit> archive_hits;
+    std::vector<MessageRuns> archive_runs;
+    float archive_scroll = 0;
+    std::vector<VisibleMessage> visible_messages;
+
     while (!WindowShouldClose()) {
-        // Check for new messages
-        check_messages(shm_ptr);
+        TRACE_SPAN("frame");
+        perf_frame_start(perf_hud);
+
+        // Check for new messages; restored history is indexed with whatever
+        // is left of the frame's ingest budget
+        int64_t ingest_start = now_us();
+        chat_poll(client, ingest_start + INGEST_BUDGET_US);
+        if (perf_hud.visible) perf_hud.current.ingest_us = now_us() - ingest_start;
 
         BeginDrawing();
         ClearBackground(RAYWHITE);
 
         // Top toolbar
         GuiPanel((Rectangle){ 0, 0, screenWidth, 50 }, NULL);
-        GuiLabel((Rectangle){ 20, 10, 400, 30 }, TextFormat("Logged in as: %s", my_username.c_str()));
+        GuiLabel((Rectangle){ 20, 10, 250, 30 }, TextFormat("Logged in as: %s", my_username.c_str()));
+
+        // Search box. The index mode re-queries when the text or the history
+        // changes; scan and archive results stream in from the worker pool.
+        // The box returns true on Enter too, which keeps it in edit mode so
+        // Enter can step through the matches.
+        bool search_enter = search_edit_mode && IsKeyPressed(KEY_ENTER);
+        if (GuiTextBox((Rectangle){ 280, 10, 180, 30 }, search_input, 128, search_edit_mode) && !search_enter) {
+            search_edit_mode = !search_edit_mode;
+        }
+        GuiToggleGroup((Rectangle){ 465, 15, 48, 20 }, "Index;Scan;Archive", &search_mode);
+
+        bool search_changed = search_text != search_input || search_mode != search_mode_shown;
+        if (search_changed) {
+            chat_search_stop(client);
+            search_text = search_input;
+            search_matches.clear();
+            archive_hits.clear();
+            archive_runs.clear();
+            archive_scroll = 0;
+        }
+
+        ChatSearchStatus status = chat_search_status(client);
+        if (search_mode == SEARCH_SCAN) {
+            if (search_changed) chat_scan_start(client, search_text);
+            chat_scan_drain(client, search_matches);
+        } else if (search_mode == SEARCH_ARCHIVE) {
+            if (search_changed) chat_archive_search_start(client, search_text);
+            if (chat_archive_search_drain(client, archive_hits)) archive_runs.clear();
+        } else if (search_changed || search_count != status.indexed) {
+            search_count = status.indexed;
+            chat_index_query(client, search_text, search_matches);
+        }
+        search_mode_shown = search_mode;
+
+        const char* search_status = "Search";
+        if (search_mode == SEARCH_ARCHIVE && !search_text.empty()) {
+            search_status = TextFormat(status.archive_running ? "%d hits..." : "%d hits", (int)status.archive_matched);
+        } else if (!search_text.empty()) {
+            bool pending = search_mode == SEARCH_SCAN ? status.scanning : status.backfilling;
+            search_status = TextFormat(pending ? "%d found..." : "%d found", (int)search_matches.size());
+        }
+        GuiLabel((Rectangle){ 620, 10, 75, 30 }, search_status);
+        bool show_archive = search_mode == SEARCH_ARCHIVE && !search_text.empty();
 
         // Chat area background
-        Rectangle chat_area = { 20, 70, screenWidth - 40, 360 };
         DrawRectangle(chat_area.x, chat_area.y, chat_area.width, chat_area.height, (Color){240, 240, 240, 255});
         DrawRectangleLines(chat_area.x, chat_area.y, chat_area.width, chat_area.height, DARKGRAY);
 
+        // Enter in the search box jumps to the closest match above the view,
+        // wrapping around to the newest one
+        if (!show_archive && search_enter && !search_matches.empty()) {
+            size_t target = search_matches.size() - 1;
+            for (size_t m = search_matches.size(); m-- > 0;) {
+                if (chat_message_y(client, search_matches[m]) < (int)scroll_offset) {
+                    target = m;
+                    break;
+                }
+            }
+            scroll_offset = chat_message_y(client, search_matches[target]);
+        }
+
         // Handle scrolling
         float mouse_wheel = GetMouseWheelMove();
+        float& scroll = show_archive ? archive_scroll : scroll_offset;
         if (mouse_wheel != 0) {
-            scroll_offset -= mouse_wheel * 20;
-            if (scroll_offset < 0) scroll_offset = 0;
+            // The live list can scroll up into older history fetched from the log
+            float scroll_min = show_archive ? 0 : (float)-older_history.height;
+            scroll -= mouse_wheel * 20;
+            if (scroll < scroll_min) scroll = scroll_min;
         }
 
         // Clip messages to chat area
         BeginScissorMode(chat_area.x, chat_area.y, chat_area.width, chat_area.height);
+        bool tracing = trace_enabled.load(std::memory_order_relaxed);
+        int64_t draw_start = perf_hud.visible || tracing ? now_us() : 0;
+        uint32_t drawn = 0;
 
-        // Draw messages
-        int y_pos = chat_area.y + 10 - (int)scroll_offset;
-        int line_height = 20;
-
-        for (size_t i = 0; i < chat_messages.size(); i++) {
-            const Message& msg = chat_messages[i];
-
-            // Calculate message box dimensions
-            int msg_width = MeasureText(msg.text.c_str(), 10) + 20;
-            if (msg_width > chat_area.width - 60) msg_width = chat_area.width - 60;
-            int msg_height = line_height + 10;
-
-            int msg_x;
-            Color box_color;
-
-            if (msg.is_mine) {
-                // My messages on the right (green)
-                msg_x = chat_area.x + chat_area.width - msg_width - 10;
-                box_color = (Color){200, 255, 200, 255};
-            } else {
-                // Their messages on the left (white)
-                msg_x = chat_area.x + 10;
-                box_color = WHITE;
+        if (show_archive) {
+            draw_archive_hits(archive_hits, archive_runs, chat_area, archive_scroll);
+        } else {
+            // Collect visible messages into the batch
+            int list_top = chat_area.y + 10 - (int)scroll_offset;
+            int view_top = (int)chat_area.y - list_top;
+            int view_bottom = view_top + (int)chat_area.height;
+            chat_mark_read(client, view_bottom);
+
+            older_update(older_history, client, view_top, view_bottom, chat_oldest_timestamp(client), scroll_offset);
+            list_top = chat_area.y + 10 - (int)scroll_offset;
+            view_top = (int)chat_area.y - list_top;
+            view_bottom = view_top + (int)chat_area.height;
+            draw_older_history(older_history, chat_area, list_top, view_top, view_bottom);
+
+            chat_visible(client, view_top, view_bottom, visible_messages);
+            std::vector<uint32_t>::const_iterator next_match = search_matches.end();
+            if (!visible_messages.empty()) {
+                next_match = std::lower_bound(search_matches.begin(), search_matches.end(),
+                                              (uint32_t)visible_messages[0].index);
             }
 
-            // Draw message box
-            DrawRectangle(msg_x, y_pos, msg_width, msg_height, box_color);
-            DrawRectangleLines(msg_x, y_pos, msg_width, msg_height, GRAY);
-
-            // Draw message text
-            if (!msg.is_mine) {
-                // Show sender name for others
-                DrawText(msg.sender.c_str(), msg_x + 5, y_pos + 2, 8, DARKGRAY);
-                DrawText(msg.text.c_str(), msg_x + 10, y_pos + 12, 10, BLACK);
-                msg_height += 10;
-            } else {
-                DrawText(msg.text.c_str(), msg_x + 10, y_pos + 5, 10, BLACK);
+            for (size_t v = 0; v < visible_messages.size(); v++) {
+                const VisibleMessage& visible = visible_messages[v];
+                while (next_match != search_matches.end() && *next_match < visible.index) ++next_match;
+                bool is_match = next_match != search_matches.end() && *next_match == visible.index;
+
+                MessageRuns* runs = NULL;
+                if (glyph_atlas.font_data != NULL) runs = &message_runs(visible.index, visible.sender, visible.text);
+                draw_message(chat_area, list_top + visible.y, visible.sender, visible.text, visible.flags, is_match, runs);
+                drawn++;
+                if (!latency_trace.undrawn.empty()) latency_drawn(latency_trace, visible.index);
             }
+        }
 
-            y_pos += msg_height + 5;
+        batch_flush(message_batch);
+        if (tracing) trace_record("draw", draw_start);
+        trim_run_cache();
+        glyph_atlas.frame++;
+        if (perf_hud.visible) {
+            perf_hud.current.draw_us = now_us() - draw_start;
+            perf_hud.current.drawn = drawn;
+            perf_hud.current.culled = (uint32_t)(chat_history_count(client) - drawn);
         }
 
         EndScissorMode();
 
+        // Unread messages below the viewport, click to jump to the newest
+        size_t unread = show_archive ? 0 : chat_unread(client);
+        if (unread > 0 && GuiButton((Rectangle){ chat_area.x + chat_area.width - 130, chat_area.y + chat_area.height - 30, 120, 24 },
+                                    TextFormat("%d new below", (int)unread))) {
+            scroll_offset = chat_history_height(client) + 10 - chat_area.height;
+            if (scroll_offset < 0) scroll_offset = 0;
+        }
+
         // Message input area
         GuiLabel((Rectangle){ 20, 440, 200, 20 }, "Type your message:");
 
-        if (GuiTextBox((Rectangle){ 20, 465, screenWidth - 150, 30 },
-                      message_input, 256, message_edit_mode)) {
-            message_edit_mode = !message_edit_mode;
+        // Messages received but not yet spliced in, while a burst is spread over frames
+        size_t backlog = chat_backlog(client);
+        if (!chat_online(client)) {
+            GuiLabel((Rectangle){ 230, 440, 250, 20 }, TextFormat("Offline - %d queued", (int)chat_outbox_count(client)));
+        } else if (backlog > 0) {
+            GuiLabel((Rectangle){ 230, 440, 250, 20 }, TextFormat("Receiving... %d pending", (int)backlog));
+        }
+
+        bool input_toggled;
+        {
+            TRACE_SPAN("text box");
+            input_toggled = GuiTextBox((Rectangle){ 20, 465, screenWidth - 150, 30 },
+                                       message_input, 256, message_edit_mode);
         }
+        if (input_toggled) message_edit_mode = !message_edit_mode;
 
         // Send button
         if (GuiButton((Rectangle){ screenWidth - 120, 465, 100, 30 }, "Send") ||
             (message_edit_mode && IsKeyPressed(KEY_ENTER))) {
-            send_message(shm_ptr, message_input);
+            chat_send(client, message_input);
             memset(message_input, 0, sizeof(message_input));
             message_edit_mode = false;
         }
 
+        if (IsKeyPressed(KEY_F1)) perf_toggle(perf_hud);
+        if (perf_hud.visible) {
+            draw_perf_hud(perf_hud, (Rectangle){ 430, 180, 250, 160 }, chat_ring_lag(client), backlog);
+        }
+        if (IsKeyPressed(KEY_F2)) latency_trace.overlay = !latency_trace.overlay;
+        if (latency_trace.overlay) draw_latency_overlay(latency_trace, (Rectangle){ 250, 75, 430, 100 });
+        if (now_ms() >= latency_trace.next_dump) {
+            latency_dump(latency_trace);
+            latency_trace.next_dump = now_ms() + LATENCY_DUMP_MS;
+        }
+        // F3 starts recording spans; pressed again it writes them out
+        if (IsKeyPressed(KEY_F3)) {
+            if (!trace_enabled) {
+                trace_enabled = true;
+            } else if (trace_dump(trace_path(my_username))) {
+                std::cerr << "Trace written to " << trace_path(my_username) << std::endl;
+            }
+        }
+
         EndDrawing();
     }
 
     // Cleanup
-    shm_cleanup(shm_id, shm_ptr);
+    chat_close(client);
+    latency_dump(latency_trace);
+    if (trace_enabled) trace_dump(trace_path(my_username));
+    if (glyph_atlas.font_data != NULL) {
+        UnloadTexture(glyph_atlas.texture);
+        UnloadFileData(glyph_atlas.font_data);
+    }
     CloseWindow();
 
     return 0;
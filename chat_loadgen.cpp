@@ -0,0 +1,230 @@
+// Load generator: N writer and M reader clients on the shared ring the chat
+// clients use, each a thread with its own writer id or cursor. Writers send
+// bursts at a fixed rate with a configurable size distribution; readers
+// check every message for gaps and record send to receive latency from the
+// send time each slot carries. Reports throughput, loss and latency
+// percentiles at the end.
+#include "chat_client_internal.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <unistd.h>
+
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_EXP 2
+
+struct LoadOptions {
+    int writers;
+    int readers;
+    double rate;                // Messages per second per writer, 0 for as fast as possible
+    int burst;                  // Messages published back to back, with one wakeup
+    size_t size;                // Mean text size in bytes
+    int distribution;
+    double duration;            // Seconds
+};
+
+struct WriterStats {
+    uint64_t sent;
+    uint64_t bytes;
+};
+
+struct ReaderStats {
+    uint64_t received;
+    uint64_t gaps;              // Messages skipped in a writer's sequence
+    uint64_t ring_lost;         // Overwritten before they were read
+    uint64_t corrupt;
+    std::vector<uint64_t> expected;     // Next sequence number per writer
+    LatencyHistogram latency;           // Microseconds
+};
+
+std::atomic<bool> writers_stopping(false);
+std::atomic<bool> readers_stopping(false);
+uint32_t writer_base;
+
+size_t text_size(const LoadOptions& options, std::mt19937& random) {
+    double size = options.size;
+    if (options.distribution == SIZE_UNIFORM) {
+        size = std::uniform_real_distribution<double>(0, 2.0 * options.size)(random);
+    } else if (options.distribution == SIZE_EXP) {
+        size = std::exponential_distribution<double>(1.0 / options.size)(random);
+    }
+    return std::min((size_t)size, (size_t)MESSAGE_MAX - 16);
+}
+
+// Text is "<seq> " padded with filler to the drawn size
+void writer_run(ShmRing* ring, const LoadOptions* options, int id, WriterStats* stats) {
+    std::mt19937 random(id + 1);
+    char name[32];
+    snprintf(name, sizeof(name), "load%d: ", id);
+    size_t name_length = strlen(name);
+
+    std::vector<std::string> payloads(options->burst);
+    std::vector<RingPayload> batch(options->burst);
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    std::chrono::duration<double> interval(options->rate > 0 ? options->burst / options->rate : 0);
+
+    while (!writers_stopping.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < options->burst; i++) {
+            char header[32];
+            int length = snprintf(header, sizeof(header), "%llu ", (unsigned long long)(stats->sent + i));
+            std::string& payload = payloads[i];
+            payload.assign(name, name_length);
+            payload.append(header, length);
+            size_t size = text_size(*options, random);
+            if (payload.size() < name_length + size) payload.append(name_length + size - payload.size(), 'x');
+
+            RingPayload message = { (uint32_t)(stats->sent + i), wall_us(), payload.data(), payload.size() };
+            batch[i] = message;
+            stats->bytes += payload.size();
+        }
+        ring_write_batch(ring, writer_base + id, &batch[0], batch.size());
+        ring_notify(ring);
+        stats->sent += options->burst;
+
+        if (options->rate > 0) {
+            next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+void reader_run(ShmRing* ring, const LoadOptions* options, uint64_t start, ReaderStats* stats) {
+    RingCursor cursor = { start, 0, 0, 0 };
+    RingMessage msg;
+    stats->expected.assign(options->writers, 0);
+    latency_reset(stats->latency);
+
+    while (!readers_stopping.load(std::memory_order_relaxed)) {
+        if (!ring_next(ring, cursor, msg)) {
+            ring_wait(ring, cursor.next, 10);
+            continue;
+        }
+        int64_t received = wall_us();
+        uint32_t id = msg.writer - writer_base;
+        if (msg.writer < writer_base || id >= (uint32_t)options->writers) continue;
+
+        const char* colon = (const char*)memmem(msg.data, msg.length, ": ", 2);
+        if (colon == NULL) continue;
+        msg.data[std::min((size_t)msg.length, (size_t)MESSAGE_MAX - 1)] = '\0';
+        unsigned long long seq;
+        if (sscanf(colon + 2, "%llu", &seq) != 1) continue;
+
+        stats->received++;
+        if (seq > stats->expected[id]) stats->gaps += seq - stats->expected[id];
+        if (seq >= stats->expected[id]) stats->expected[id] = seq + 1;
+        latency_record(stats->latency, received - msg.sent_us);
+    }
+    stats->ring_lost = cursor.lost;
+    stats->corrupt = cursor.corrupt;
+}
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [-w writers] [-r readers] [-R rate per writer/s, 0 unlimited]"
+              << " [-b burst] [-s mean size] [-z fixed|uniform|exp] [-d seconds]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options = { 4, 4, 1000, 1, 64, SIZE_FIXED, 5 };
+    int option;
+    while ((option = getopt(argc, argv, "w:r:R:b:s:z:d:h")) != -1) {
+        switch (option) {
+            case 'w': options.writers = atoi(optarg); break;
+            case 'r': options.readers = atoi(optarg); break;
+            case 'R': options.rate = atof(optarg); break;
+            case 'b': options.burst = std::max(1, std::min(atoi(optarg), SEND_BATCH_MAX)); break;
+            case 's': options.size = std::max(1, atoi(optarg)); break;
+            case 'z':
+                if (strcmp(optarg, "uniform") == 0) options.distribution = SIZE_UNIFORM;
+                else if (strcmp(optarg, "exp") == 0) options.distribution = SIZE_EXP;
+                else options.distribution = SIZE_FIXED;
+                break;
+            case 'd': options.duration = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    int shm_id = share_memory(get_key());
+    if (shm_id == -1) {
+        std::cerr << "Failed to access shared memory" << std::endl;
+        return 1;
+    }
+    ShmRing* ring = (ShmRing*)shm_access(shm_id);
+    if (ring == (ShmRing*)-1) {
+        std::cerr << "Failed to attach shared memory" << std::endl;
+        return 1;
+    }
+    // Writer ids stay clear of the chat clients, which use their pid
+    writer_base = 0x80000000u | ((uint32_t)getpid() & 0x7fff) << 16;
+
+    // Readers start at the head so earlier traffic is not counted
+    uint64_t start = ring->head.load(std::memory_order_acquire);
+    std::vector<ReaderStats> readers(options.readers);
+    static LatencyHistogram latency;
+    std::vector<WriterStats> writers(options.writers);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.readers; i++) {
+        readers[i] = ReaderStats();
+        threads.push_back(std::thread(reader_run, ring, &options, start, &readers[i]));
+    }
+    std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.writers; i++) {
+        writers[i] = WriterStats();
+        threads.push_back(std::thread(writer_run, ring, &options, i, &writers[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    writers_stopping = true;
+    for (int i = 0; i < options.writers; i++) threads[options.readers + i].join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+
+    // Let readers drain what is still in the ring
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    readers_stopping = true;
+    ring_notify(ring);
+    for (int i = 0; i < options.readers; i++) threads[i].join();
+
+    uint64_t sent = 0, bytes = 0;
+    for (int i = 0; i < options.writers; i++) {
+        sent += writers[i].sent;
+        bytes += writers[i].bytes;
+    }
+
+    // Anything never seen from a writer's sequence counts as lost
+    uint64_t received = 0, lost = 0, ring_lost = 0, corrupt = 0;
+    latency_reset(latency);
+    for (int i = 0; i < options.readers; i++) {
+        ReaderStats& reader = readers[i];
+        received += reader.received;
+        lost += reader.gaps;
+        for (int w = 0; w < options.writers; w++) lost += writers[w].sent - reader.expected[w];
+        ring_lost += reader.ring_lost;
+        corrupt += reader.corrupt;
+        for (size_t b = 0; b < LATENCY_BUCKETS; b++) latency.counts[b] += reader.latency.counts[b];
+        latency.total += reader.latency.total;
+        latency.max = std::max(latency.max, reader.latency.max);
+    }
+
+    uint64_t expected = sent * options.readers;
+    printf("writers %d readers %d rate %.0f/s burst %d size %zu over %.2fs\n",
+           options.writers, options.readers, options.rate, options.burst, options.size, elapsed);
+    printf("sent      %llu messages, %.0f msg/s, %.2f MB/s\n", (unsigned long long)sent,
+           sent / elapsed, bytes / elapsed / (1024 * 1024));
+    printf("received  %llu of %llu, %.0f msg/s per reader\n", (unsigned long long)received,
+           (unsigned long long)expected, options.readers > 0 ? received / elapsed / options.readers : 0.0);
+    printf("lost      %llu (%.3f%%), overwritten in ring %llu, corrupt %llu\n", (unsigned long long)lost,
+           expected > 0 ? 100.0 * lost / expected : 0.0, (unsigned long long)ring_lost, (unsigned long long)corrupt);
+    printf("latency   p50 %lld us  p90 %lld us  p99 %lld us  p999 %lld us  max %lld us\n",
+           (long long)latency_percentile(latency, 0.5), (long long)latency_percentile(latency, 0.9),
+           (long long)latency_percentile(latency, 0.99), (long long)latency_percentile(latency, 0.999),
+           (long long)latency.max);
+
+    shm_cleanup((char*)ring);
+    return 0;
+}
@@ -0,0 +1,172 @@
+// Self-check for the client library's formats and arithmetic: CRC32C against
+// its check value and across implementations, latency histogram percentile
+// bounds, and a history snapshot saved and loaded back, spilled pages and
+// pending sends included. Prints each failure and exits non-zero if any.
+#include "chat_client_internal.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+#define SELFTEST_MESSAGES 5000
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAIL " << what << std::endl;
+    failures++;
+}
+
+void check_crc32c() {
+    const char* digits = "123456789";
+    check(crc32c(0, digits, 9) == 0xE3069283, "crc32c check value");
+    check(crc32c_software(0, digits, 9) == 0xE3069283, "crc32c_software check value");
+    check(crc32c(crc32c(0, digits, 4), digits + 4, 5) == 0xE3069283, "crc32c chained");
+
+    // Every length and alignment the wide loop and its tail can see
+    std::mt19937 random(1);
+    std::vector<unsigned char> buffer(256);
+    for (size_t i = 0; i < buffer.size(); i++) buffer[i] = (unsigned char)random();
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 0; offset + length <= buffer.size(); length++) {
+            if (crc32c(0, &buffer[offset], length) != crc32c_software(0, &buffer[offset], length)) {
+                check(false, "crc32c matches crc32c_software at offset " + std::to_string(offset) +
+                             " length " + std::to_string(length));
+                return;
+            }
+        }
+    }
+}
+
+void check_latency() {
+    LatencyHistogram histogram;
+    latency_reset(histogram);
+    check(latency_percentile(histogram, 0.5) == 0, "empty histogram percentile");
+
+    // A single value comes back within half a bucket, 1/64, and never above it
+    for (int64_t value = 1; value <= LATENCY_MAX; value = value * 3 / 2 + 1) {
+        latency_reset(histogram);
+        latency_record(histogram, value);
+        int64_t p50 = latency_percentile(histogram, 0.5);
+        if (p50 > value || (value - p50) * 64 > value) {
+            check(false, "single value " + std::to_string(value) + " read back as " + std::to_string(p50));
+            return;
+        }
+    }
+
+    // Uniform 1..100000: percentiles land near their rank and are ordered
+    latency_reset(histogram);
+    for (int64_t value = 1; value <= 100000; value++) latency_record(histogram, value);
+    const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    int64_t previous = 0;
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+        int64_t expected = (int64_t)(fractions[i] * 100000);
+        int64_t found = latency_percentile(histogram, fractions[i]);
+        check(llabs(found - expected) * 32 <= expected, "p" + std::to_string(fractions[i]) + " " + std::to_string(found));
+        check(found >= previous, "percentiles ordered");
+        previous = found;
+    }
+    int64_t p100 = latency_percentile(histogram, 1.0);
+    check(p100 <= 100000 && (100000 - p100) * 64 <= 100000, "p100 within half a bucket of the max");
+    check(histogram.total == 100000 && histogram.max == 100000, "histogram total and max");
+
+    // Out of range values are clamped rather than lost
+    latency_reset(histogram);
+    latency_record(histogram, -5);
+    latency_record(histogram, LATENCY_MAX * 4);
+    check(histogram.total == 2, "clamped values counted");
+}
+
+struct SnapshotMessage {
+    std::string sender;
+    std::string text;
+    int64_t timestamp;
+    uint32_t flags;
+};
+
+void history_messages(MessageHistory& history, std::vector<SnapshotMessage>& out) {
+    for (size_t p = 0; p < history.pages.size(); p++) {
+        HistoryPage& page = history_load_page(history, p);
+        for (uint32_t k = 0; k < page.count; k++) {
+            SnapshotMessage message = { history_sender(history, page, k), history_text(page, k),
+                                        page.index->timestamps[k], page.index->flags[k] };
+            out.push_back(message);
+        }
+    }
+}
+
+void check_snapshot() {
+    // A small budget so most pages are spilled when the snapshot is written
+    MessageHistory history;
+    history_init(history);
+    history.budget = 4 * PAGE_TEXT_BYTES;
+
+    std::vector<SnapshotMessage> expected;
+    for (size_t i = 0; i < SELFTEST_MESSAGES; i++) {
+        SnapshotMessage message;
+        message.sender = "user" + std::to_string(i % 7);
+        message.text = "message " + std::to_string(i) + std::string(i % 97, 'x');
+        message.timestamp = 1700000000000LL + (int64_t)i;
+        message.flags = i % 7 == 0 ? MSG_MINE : 0;
+        if (i % 50 == 0) message.flags = MSG_MINE | MSG_PENDING;
+        history_append(history, message.sender.data(), message.sender.size(), message.text.data(),
+                       message.text.size(), message.flags, message.timestamp);
+        if (i % 100 == 0) {
+            history.frame++;
+            history_trim(history);
+        }
+        if (!(message.flags & MSG_PENDING)) expected.push_back(message);
+    }
+    history.frame++;
+    history_trim(history);
+    check(history.spill != NULL, "history spilled before the snapshot");
+
+    char path[] = "/tmp/chat_selftest_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        check(false, "temporary snapshot file");
+        history_free(history);
+        return;
+    }
+    close(fd);
+
+    check(history_save_snapshot(history, path, 12345), "snapshot saved");
+    MessageHistory loaded;
+    history_init(loaded);
+    uint64_t ring_next = 0;
+    check(history_load_snapshot(loaded, path, &ring_next), "snapshot loaded");
+    check(ring_next == 12345, "snapshot ring position");
+    check(loaded.count == expected.size(), "snapshot message count, pending sends left out");
+
+    std::vector<SnapshotMessage> found;
+    history_messages(loaded, found);
+    int height = 0;
+    bool same = found.size() == expected.size();
+    for (size_t i = 0; same && i < found.size(); i++) {
+        same = found[i].sender == expected[i].sender && found[i].text == expected[i].text &&
+               found[i].timestamp == expected[i].timestamp && found[i].flags == expected[i].flags;
+        height += message_height(expected[i].flags);
+    }
+    check(same, "snapshot messages equal");
+    check(loaded.height == height, "snapshot height");
+
+    history_free(loaded);
+    history_free(history);
+    unlink(path);
+}
+
+int main() {
+    check_crc32c();
+    check_latency();
+    check_snapshot();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}